@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cmath>
 #include <chrono>
 #include <iostream>
@@ -37,6 +38,40 @@ Options:
     annealing schedule (e.g. "1 to 0 in 500 steps"), or schedule that tries to 
     achieve a certain acceptance rate (e.g. "auto 50%").
     
+  --heat-bath
+    Instead of proposing a random base for a random position and accepting or 
+    rejecting it, score all four bases for a random position (in parallel, 
+    using --threads) and pick one according to their Boltzmann weights.  Every 
+    move is accepted, but each costs three evaluations instead of one.
+    
+  --early-rejection
+    Draw the random number for the Metropolis criterion before scoring each 
+    move, then stop scoring as soon as it's clear that the move will be 
+    rejected.  This skips a lot of folding at low temperatures.  Moves that 
+    are rejected early have no proposed score in the trajectory file, and 
+    don't train an adaptive thermostat, so the same decisions are made 
+    unless the temperature schedule adapts to the scores (e.g. "auto 50%").
+    
+  --delayed-acceptance
+    Screen each move with a cheap Metropolis test before scoring it exactly.  
+    The cheap test estimates each macrostate probability from minimum free 
+    energies instead of partition functions.  Moves that pass are accepted or 
+    rejected by a second test that corrects for the estimate, so the sequences 
+    are still sampled from the right distribution, but the trajectory will 
+    differ from one without this option.  Moves rejected by the cheap test 
+    aren't scored exactly, so they have no proposed score in the trajectory 
+    file.
+    
+  -K <num>, --speculate <num>                [default: 1]
+    Propose this many moves from the current sequence at once, and score them 
+    all together, so the folding can be spread across --threads even if each 
+    move only needs one partition function.  The proposals are then considered one at 
+    a time, until one is accepted and the rest are discarded.  This samples 
+    the same distribution as one proposal at a time, and is faster when most 
+    moves are rejected (i.e. at low temperature).  The trajectory depends on 
+    the number of proposals.  Can't be combined with --heat-bath or 
+    --delayed-acceptance.
+    
   -r <seed>, --random-seed <seed>            [default: 0]
     The seed for the random number generator.  If running in parallel, this 
     should be different for each job.
@@ -48,6 +83,68 @@ Options:
   -i <steps>, --output-interval <steps>      [default: 1]
     How often a new snapshot in the trajectory should be recorded.
     
+  -c <num>, --cache <num>                    [default: 0]
+    The number of scores to remember, so that sequences the simulation has 
+    already visited don't have to be refolded.  By default, nothing is 
+    remembered.
+    
+  --cache-policy <policy>                    [default: lru]
+    Which score to forget when the cache is full: the least recently used 
+    ("lru") or the first one that was remembered ("fifo").
+    
+  -N <num>, --trajectories <num>             [default: 1]
+    The number of independent design simulations to run.  The simulations 
+    share the same score function, and are run in parallel if --threads is 
+    greater than 1.  The random seed for each simulation is --random-seed plus 
+    the index of the simulation.  If there's more than one simulation, each 
+    writes its own trajectory, named after --output with the index of the 
+    simulation added (e.g. "traj_0.tsv").
+    
+  -j <num>, --threads <num>                  [default: 1]
+    The number of threads to use.  Each trajectory (or replica, if --replicas 
+    is given) is simulated on its own thread.  If there's only one trajectory, 
+    the partition functions needed to score each move (e.g. for each 
+    condition, context, and speculative proposal) are calculated on separate 
+    threads instead.
+    
+  --steepest-descent
+    Polish the starting sequence instead of running a design simulation.  
+    Every single mutation is scored (in parallel, using --threads), the best 
+    one is made, and this repeats until no mutation improves the score or 
+    --num-moves mutations have been made.  The path is written to --output in 
+    the same format as a trajectory.
+    
+  --genetic-algorithm <size>
+    Evolve a population of this many sequences instead of running a design 
+    simulation.  --num-moves is the number of generations.  The sequences in 
+    each generation are scored in parallel, using --threads.  The best 
+    sequence in each generation is written to --output.
+    
+  --population-annealing <walkers>
+    Anneal this many walkers instead of running a design simulation.  Each 
+    walker makes --num-moves moves at each temperature, then the walkers are 
+    resampled by their Boltzmann weights at the next temperature.  The walkers 
+    are moved in parallel, using --threads.  The best sequence at each 
+    temperature is written to --output, and the free energy and effective 
+    number of walkers at each temperature are printed.
+    
+  --annealing-temperatures <temperatures>    [default: 0.1,0.2,0.5,1,2,4]
+    The temperatures to visit if --population-annealing is given, separated 
+    by commas and listed in increasing order.  The walkers start at the 
+    highest temperature.
+    
+  --replicas <temperatures>
+    Run a replica exchange simulation instead of a single simulation.  There 
+    will be one replica at each of the given temperatures, which should be 
+    separated by commas and listed in increasing order (e.g. "0.5,1,2,4").  
+    Each replica writes its own trajectory, named after --output with the 
+    index of the replica added (e.g. "traj_0.tsv").  The --temperature option 
+    is ignored.
+    
+  --swap-interval <steps>                    [default: 10]
+    How many moves each replica makes between attempts to swap devices with 
+    its neighbors, if --replicas is given.
+    
   --version
     Display the version of ``addapt`` being used.
     
@@ -55,6 +152,18 @@ Options:
     Display this usage information.
 )""";
 
+/// @brief Add the given number to the given path, just before the extension.
+string numbered_path(string path, int i) {
+	size_t dot = path.rfind('.');
+	size_t slash = path.rfind('/');
+
+	if(dot == string::npos or (slash != string::npos and dot < slash)) {
+		dot = path.length();
+	}
+
+	return path.substr(0, dot) + "_" + to_string(i) + path.substr(dot);
+}
+
 int main(int argc, char **argv) {
 	try {
 		map<string, docopt::value> args = docopt::docopt(
@@ -66,30 +175,280 @@ int main(int argc, char **argv) {
 
 		// Create the score function.
 		ScoreFunctionPtr scorefxn = scorefxn_from_yaml(config_files);
+		scorefxn->cache(cache_from_str(
+				args["--cache"].asString(),
+				args["--cache-policy"].asString()));
 
 		// Create the Monte Carlo sampler.
-		MonteCarloPtr sampler = make_shared<MonteCarlo>();
-		*sampler += make_shared<UnbiasedMutationMove>();
+		int const num_threads = stoi(args["--threads"].asString());
+		bool const early_rejection = args["--early-rejection"].asBool();
+		bool const delayed_acceptance = args["--delayed-acceptance"].asBool();
+
+		ScoreFunctionPtr surrogate = delayed_acceptance?
+			scorefxn->surrogate() : nullptr;
+		vector<MonteCarloPtr> all_samplers;
+
+		auto make_sampler = [&](
+				ThermostatPtr thermostat, string output_path, bool progress_bar) {
+
+			MonteCarloPtr sampler = make_shared<MonteCarlo>();
+			if(args["--heat-bath"].asBool()) {
+				*sampler += make_shared<HeatBathMove>();
+			}
+			else {
+				*sampler += make_shared<UnbiasedMutationMove>();
+			}
+
+			sampler->num_steps(stoi(args["--num-moves"].asString()));
+			sampler->scorefxn(scorefxn);
+			sampler->thermostat(thermostat);
+			sampler->early_rejection(early_rejection);
+			sampler->surrogate_scorefxn(surrogate);
+			sampler->speculation(stoi(args["--speculate"].asString()));
+
+			if(progress_bar) {
+				sampler->add_reporter(make_shared<ProgressReporter>());
+			}
+			sampler->add_reporter(make_shared<TsvTrajectoryReporter>(
+					output_path, stoi(args["--output-interval"].asString())));
+
+			all_samplers.push_back(sampler);
+			return sampler;
+		};
+
+		int const seed = stoi(args["--random-seed"].asString());
+		int const num_trajectories = stoi(args["--trajectories"].asString());
+		std::mt19937 rng(seed);
+
+		if(num_trajectories < 1) {
+			throw (f("can't run %d trajectories") % num_trajectories).str();
+		}
+		if(num_trajectories > 1 and args["--replicas"]) {
+			throw string("can't run more than one replica exchange simulation");
+		}
+		if(args["--steepest-descent"].asBool() and
+				(num_trajectories > 1 or args["--replicas"])) {
+			throw string("can't run more than one steepest descent");
+		}
+		if(args["--genetic-algorithm"] and (num_trajectories > 1 or 
+				args["--replicas"] or args["--steepest-descent"].asBool())) {
+			throw string("can't run a genetic algorithm alongside anything else");
+		}
+		if(args["--population-annealing"] and (num_trajectories > 1 or 
+				args["--replicas"] or args["--steepest-descent"].asBool() or 
+				args["--genetic-algorithm"])) {
+			throw string("can't run population annealing alongside anything else");
+		}
+		if(args["--heat-bath"].asBool() and stoi(args["--speculate"].asString()) > 1) {
+			throw string("can't use heat-bath moves with speculative proposals");
+		}
+
+		// Polish the starting sequence, if requested.
+		if(args["--steepest-descent"].asBool()) {
+			SteepestDescent descent;
+			descent.max_steps(stoi(args["--num-moves"].asString()));
+			descent.scorefxn(scorefxn);
+			descent += make_shared<TsvTrajectoryReporter>(
+					args["--output"].asString(),
+					stoi(args["--output-interval"].asString()));
+
+			scorefxn->num_threads(num_threads);
+			DevicePtr optimum = descent.apply(device);
+
+			SteepestDescentCounters counters = descent.counters();
+			cout << f("Steepest descent: %s (%d neighbors scored, %d reused)")
+				% optimum->seq() % counters.neighbors_scored
+				% counters.neighbors_reused << endl;
+		}
+
+		// Evolve a population of sequences, if requested.
+		else if(args["--genetic-algorithm"]) {
+			GeneticAlgorithm evolution;
+			evolution.population_size(
+					stoi(args["--genetic-algorithm"].asString()));
+			evolution.num_generations(stoi(args["--num-moves"].asString()));
+			evolution.scorefxn(scorefxn);
+			evolution += make_shared<UnbiasedMutationMove>();
+			evolution += make_shared<ProgressReporter>();
+			evolution += make_shared<TsvTrajectoryReporter>(
+					args["--output"].asString(),
+					stoi(args["--output-interval"].asString()));
+
+			scorefxn->num_threads(num_threads);
+			evolution.apply(device, rng);
+
+			long num_scored = 0;
+			double seconds = 0;
+			for(auto const &stats: evolution.generation_stats()) {
+				num_scored += stats.num_scored;
+				seconds += stats.seconds;
+			}
+			cout << f("Genetic algorithm: %.1f sequences scored per second, %.1f%% diversity in the last generation")
+				% (seconds? num_scored / seconds : 0.0)
+				% (100 * evolution.generation_stats().back().diversity) << endl;
+		}
+
+		// Anneal a population of walkers, if requested.
+		else if(args["--population-annealing"]) {
+			vector<double> temperatures = temperatures_from_str(
+					args["--annealing-temperatures"].asString());
+			std::reverse(temperatures.begin(), temperatures.end());
+
+			PopulationAnnealing annealer;
+			annealer.temperatures(temperatures);
+			annealer.population_size(
+					stoi(args["--population-annealing"].asString()));
+			annealer.steps_per_temperature(stoi(args["--num-moves"].asString()));
+			annealer.num_threads(num_threads);
+			annealer.scorefxn(scorefxn);
+			annealer += make_shared<UnbiasedMutationMove>();
+			annealer += make_shared<TsvTrajectoryReporter>(
+					args["--output"].asString(),
+					stoi(args["--output-interval"].asString()));
+
+			annealer.apply(device, rng);
+
+			for(auto const &stats: annealer.annealing_stats()) {
+				cout << f("Population annealing (T=%g): free energy %.3f, %.1f effective walkers (%.1f%%), %d families")
+					% stats.temperature % stats.free_energy % stats.effective_size
+					% (100 * stats.effective_size / annealer.population_size())
+					% stats.num_families << endl;
+			}
+		}
+
+		// Run a replica exchange simulation, if requested.
+		else if(args["--replicas"]) {
+			vector<double> temperatures =
+				temperatures_from_str(args["--replicas"].asString());
+
+			ReplicaExchange exchange;
+			exchange.swap_interval(stoi(args["--swap-interval"].asString()));
+			exchange.num_threads(num_threads);
+
+			for(int k = 0; k < int(temperatures.size()); k++) {
+				exchange += make_sampler(
+						make_shared<FixedThermostat>(temperatures[k]),
+						numbered_path(args["--output"].asString(), k),
+						false);
+			}
+
+			exchange.apply(device, rng);
+
+			vector<double> rates = exchange.swap_acceptance_rates();
+			for(int k = 0; k < int(rates.size()); k++) {
+				cout << f("Swap acceptance (T=%g <-> T=%g): %.1f%%")
+					% temperatures[k] % temperatures[k + 1] % (100 * rates[k]) << endl;
+			}
+		}
+
+		// Otherwise, run the requested number of independent design simulations.  
+		// Each simulation needs its own thermostat, because thermostats can keep 
+		// track of the simulation's progress, and its own random number 
+		// generator, seeded in order so that the results don't depend on how the 
+		// simulations are scheduled.  Everything is set up before any of the 
+		// simulations start, so that no files are read in parallel.
+		else if(num_trajectories > 1) {
+			string thermostat_spec = args["--temperature"]?
+				args["--temperature"].asString() :
+				thermostat_spec_from_yaml(config_files);
+
+			vector<MonteCarloPtr> samplers;
+			vector<std::mt19937> trajectory_rngs;
+
+			for(int i = 0; i < num_trajectories; i++) {
+				samplers.push_back(make_sampler(
+						thermostat_from_str(thermostat_spec),
+						numbered_path(args["--output"].asString(), i), false));
+				trajectory_rngs.emplace_back(rng());
+			}
+
+			parallel_for(num_trajectories, num_threads, [&](int i) {
+					samplers[i]->apply(device->copy(), trajectory_rngs[i]);
+			});
+		}
+
+		// Otherwise, run a single design simulation.
+		else {
+			ThermostatPtr thermostat = args["--temperature"]? 
+				thermostat_from_str(args["--temperature"].asString()) :
+				thermostat_from_yaml(config_files);
+
+			scorefxn->num_threads(num_threads);
+			make_sampler(thermostat, args["--output"].asString(), true)
+				->apply(device, rng);
+		}
+
+		// Report how much folding was done.
+		RnaFoldCounters pf_counters = ViennaRnaFold::counters();
+		FoldCompoundPoolCounters pool_counters = FoldCompoundPool::counters();
+		cout << f("Partition functions: %d calculated, %d avoided")
+			% pf_counters.pf_calls % pf_counters.pf_calls_saved << endl;
+		cout << f("Fold compounds: %d allocated, %d reused")
+			% pool_counters.allocations % pool_counters.reuses << endl;
+
+		ScoreFunctionCounters fold_counters = scorefxn->counters();
+		cout << f("DP memory: at most %.1f MB per score function evaluation")
+			% (fold_counters.peak_bytes_per_evaluation / 1e6) << endl;
+
+		// Report how many partition functions were merged by the fold planner.
+		if(fold_counters.fold_requests > 0) {
+			cout << f("Fold planner: %d jobs for %d requests")
+				% fold_counters.fold_jobs % fold_counters.fold_requests << endl;
+		}
+
+		// Report where the time spent folding went.
+		for(auto const &item: fold_counters.fold_timings) {
+			string macrostate = item.first.second.empty()?
+				"unconstrained" : item.first.second;
+			cout << f("Fold time (%s, %s): %.2f s for %d jobs")
+				% item.first.first % macrostate
+				% item.second.seconds % item.second.jobs << endl;
+		}
 
-		ThermostatPtr thermostat = args["--temperature"]? 
-			thermostat_from_str(args["--temperature"].asString()) :
-			thermostat_from_yaml(config_files);
+		// Report how many score terms were skipped by early rejection.
+		if(early_rejection) {
+			RnaFoldCounters fold_counters = ViennaRnaFold::counters();
+			long total = fold_counters.pf_calls + fold_counters.pf_calls_skipped;
+			cout << f("Early rejection: skipped %d of %d partition functions (%.1f%%)")
+				% fold_counters.pf_calls_skipped % total
+				% (total? 100.0 * fold_counters.pf_calls_skipped / total : 0.0) << endl;
+		}
 
-		ReporterPtr progress_bar = make_shared<ProgressReporter>();
-		ReporterPtr traj_reporter = make_shared<TsvTrajectoryReporter>(
-				args["--output"].asString(),
-				stoi(args["--output-interval"].asString()));
+		// Report how many moves were rejected without being scored exactly.
+		if(delayed_acceptance) {
+			long prescreened = 0, rejections = 0, pf_calls_saved = 0;
+			for(auto sampler: all_samplers) {
+				prescreened += sampler->counters().prescreened;
+				rejections += sampler->counters().prescreen_rejections;
+				pf_calls_saved += sampler->counters().prescreen_pf_calls_saved;
+			}
+			cout << f("Delayed acceptance: %d of %d moves rejected by the MFE prescreen (%.1f%%)")
+				% rejections % prescreened
+				% (prescreened? 100.0 * rejections / prescreened : 0.0) << endl;
+			cout << f("Delayed acceptance: %d partition functions avoided, %d MFE calculations")
+				% pf_calls_saved % pf_counters.mfe_calls << endl;
+		}
 
-		sampler->num_steps(stoi(args["--num-moves"].asString()));
-		sampler->scorefxn(scorefxn);
-		sampler->thermostat(thermostat);
-		sampler->add_reporter(progress_bar);
-		sampler->add_reporter(traj_reporter);
+		// Report how many speculative proposals were wasted.
+		if(stoi(args["--speculate"].asString()) > 1) {
+			long proposals = 0, discarded = 0;
+			for(auto sampler: all_samplers) {
+				proposals += sampler->counters().speculative_proposals;
+				discarded += sampler->counters().speculative_proposals_discarded;
+			}
+			cout << f("Speculation: %d of %d proposals discarded (%.1f%%)")
+				% discarded % proposals
+				% (proposals? 100.0 * discarded / proposals : 0.0) << endl;
+		}
 
-		std::mt19937 rng(stoi(args["--random-seed"].asString()));
+		// Report how useful the cache was.
+		if(ScoreCachePtr cache = scorefxn->cache()) {
+			ScoreCacheCounters counters = cache->counters();
+			cout << f("Score cache (%s, %d entries): %d hits, %d misses, %d evictions")
+				% cache->eviction() % cache->capacity()
+				% counters.hits % counters.misses % counters.evictions << endl;
+		}
 
-		// Run the design simulation.
-		sampler->apply(device, rng);
 		return 0;
 	}
 	catch(YAML::Exception exc) {
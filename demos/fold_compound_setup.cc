@@ -0,0 +1,75 @@
+// Compare the cost of setting up a fold compound the way ViennaRNA does by
+// default (deriving new Boltzmann factors every time) with the cost of using
+// the factors shared by FoldParameters, and put both in perspective by
+// timing a partition function calculation for the same sequence.
+//
+// $ g++ -std=c++11 -O2 -fopenmp -I include -o fold_compound_setup
+//       demos/fold_compound_setup.cc -L .libs -laddapt -lRNA
+// $ ./fold_compound_setup
+
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <boost/format.hpp>
+
+extern "C" {
+  #include <ViennaRNA/part_func.h>
+}
+
+#include "scoring.hh"
+
+using namespace std;
+using namespace addapt;
+using f = boost::format;
+
+template <class Function> double
+time_per_call(int n, Function function) {
+	auto start = chrono::steady_clock::now();
+	for(int i = 0; i < n; i++) {
+		function();
+	}
+	chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+	return elapsed.count() / n;
+}
+
+int main(int argc, char **argv) {
+	int const num_reps = 200;
+	mt19937 rng(0);
+	uniform_int_distribution<int> nucleotide(0, 3);
+
+	// Derive the shared parameters before timing anything.
+	FoldParameters const &parameters = FoldParameters::shared();
+	vrna_md_t md = parameters.model_details(false);
+
+	cout << "  len  default (ms)   shared (ms)   pf (ms)   setup saved" << endl;
+
+	for(int len: {20, 50, 100, 200, 400}) {
+		string seq;
+		for(int i = 0; i < len; i++) {
+			seq += "ACGU"[nucleotide(rng)];
+		}
+
+		double t_default = time_per_call(num_reps, [&]() {
+				auto *fc = vrna_fold_compound(seq.c_str(), &md, VRNA_OPTION_PF);
+				vrna_fold_compound_free(fc);
+		});
+
+		double t_shared = time_per_call(num_reps, [&]() {
+				auto *fc = parameters.make_fold_compound(seq, false);
+				vrna_fold_compound_free(fc);
+		});
+
+		auto *fc = parameters.make_fold_compound(seq, false);
+		double t_pf = time_per_call(num_reps, [&]() { vrna_pf(fc, NULL); });
+		vrna_fold_compound_free(fc);
+
+		// How much of a from-scratch fold-and-PF is saved by sharing parameters.
+		double saved = (t_default - t_shared) / (t_default + t_pf);
+
+		cout << f("%5d  %12.4f  %12.4f  %8.4f  %11.1f%%")
+			% len % (1e3 * t_default) % (1e3 * t_shared) % (1e3 * t_pf)
+			% (100 * saved) << endl;
+	}
+
+	return 0;
+}
@@ -0,0 +1,67 @@
+// Measure how much speculative proposals speed up a design simulation, and
+// how that depends on the acceptance rate.  Each simulation is run once
+// without speculation and once for each number of speculative proposals,
+// using every available thread to fold the proposals.
+//
+// $ g++ -std=c++11 -O2 -fopenmp -I include -o speculative_proposals
+//       demos/speculative_proposals.cc -L .libs -laddapt -lRNA -lyaml-cpp
+// $ ./speculative_proposals <config>...
+
+#include <chrono>
+#include <iostream>
+#include <omp.h>
+#include <boost/format.hpp>
+
+#include "config.hh"
+#include "sampling.hh"
+
+using namespace std;
+using namespace addapt;
+using f = boost::format;
+
+int main(int argc, char **argv) {
+	vector<string> config_files(argv + 1, argv + argc);
+	DevicePtr device = device_from_yaml(config_files);
+	ScoreFunctionPtr scorefxn = scorefxn_from_yaml(config_files);
+	scorefxn->num_threads(omp_get_max_threads());
+
+	int const num_steps = 200;
+
+	cout << "    T   K  accepted  time (s)  speed-up  discarded" << endl;
+
+	for(double temperature: {0.1, 0.5, 2.0}) {
+		double t_serial = 0;
+
+		for(int num_proposals: {1, 2, 4, 8}) {
+			MonteCarlo sampler;
+			sampler += make_shared<UnbiasedMutationMove>();
+			sampler.num_steps(num_steps);
+			sampler.scorefxn(scorefxn);
+			sampler.thermostat(make_shared<FixedThermostat>(temperature));
+			sampler.speculation(num_proposals);
+
+			mt19937 rng(0);
+			MonteCarloStep step;
+
+			auto start = chrono::steady_clock::now();
+			sampler.start(step, device->copy(), rng);
+			while(step.i < step.num_steps) {
+				sampler.iterate(step, rng);
+			}
+			sampler.finish(step);
+			chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+			if(num_proposals == 1) t_serial = elapsed.count();
+
+			int accepted = step.num_steps - step.outcome_counters[OutcomeEnum::REJECT];
+			MonteCarloCounters counters = sampler.counters();
+
+			cout << f("%5.1f  %2d  %7.1f%%  %8.2f  %8.2f  %9d")
+				% temperature % num_proposals % (100.0 * accepted / num_steps)
+				% elapsed.count() % (t_serial / elapsed.count())
+				% counters.speculative_proposals_discarded << endl;
+		}
+	}
+
+	return 0;
+}
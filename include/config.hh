@@ -16,11 +16,20 @@ scorefxn_from_yaml(vector<string>);
 ScoreTermPtr
 score_term_from_str(ConditionEnum, string);
 
+string
+thermostat_spec_from_yaml(vector<string>);
+
 ThermostatPtr
 thermostat_from_yaml(vector<string>);
 
 ThermostatPtr
 thermostat_from_str(string);
 
+vector<double>
+temperatures_from_str(string);
+
+ScoreCachePtr
+cache_from_str(string, string);
+
 
 }
@@ -1,8 +1,12 @@
 #pragma once
 
+#include <cstdint>
+#include <functional>
 #include <iostream>
 #include <iterator>
 #include <memory>
+#include <mutex>
+#include <tuple>
 #include <vector>
 
 #include "utils.hh"
@@ -19,6 +23,33 @@ using AptamerConstPtr = std::shared_ptr<Aptamer const>;
 class Context;
 using ContextConstPtr = std::shared_ptr<Context const>;
 
+class MacrostateTable;
+using MacrostateTableConstPtr = std::shared_ptr<MacrostateTable const>;
+
+class HardConstraint;
+using HardConstraintConstPtr = std::shared_ptr<HardConstraint const>;
+
+class PositionGraph;
+using PositionGraphConstPtr = std::shared_ptr<PositionGraph const>;
+
+/// @brief A point mutation made to a device, recorded so that it can be 
+/// undone or replayed on another device.
+struct Mutation {
+	int index;
+	char before, after;
+};
+using MutationLog = std::vector<Mutation>;
+
+/// @brief A sequence to design, along with the macrostates that define its 
+/// behavior and the context it's operating in.
+///
+/// @details The sequence is packed two bits per nucleotide, with a separate 
+/// bitmask recording which positions are mutable (i.e. upper case).  Anything 
+/// other than ACGU (e.g. "N") is kept in a short list of exceptions.  The 
+/// macrostates, context, and position graph are immutable and shared between 
+/// copies, so copying a device only copies the packed sequence.  Individual 
+/// nucleotides are read straight from the packed sequence (or the context), 
+/// so only seq() has to build a string.
 class Device {
 
 public:
@@ -29,7 +60,9 @@ public:
 	/// @brief Return the length of this device.
 	int len() const;
 
-	/// @brief Return the sequence of this device.
+	/// @brief Return the sequence of this device, including the current 
+	/// context.  The string is built from the packed sequence each time, so use 
+	/// seq(int) to read individual nucleotides.
 	string seq() const;
 
 	/// @brief Return the nucleotide at the given position of this device.
@@ -52,6 +85,21 @@ public:
 	/// @brief Add constraints that define a particular macrostate.
 	void add_macrostate(string, string);
 
+	/// @brief Return the macrostates of this device, neglecting the current 
+	/// context.
+	MacrostateTableConstPtr macrostate_table() const;
+
+	/// @brief Return the constraints that define the given macrostate in the 
+	/// current context, compiled so they can be applied without being parsed.  
+	/// Each macrostate is only compiled once for each context length, and the 
+	/// result is shared by every copy of this device.
+	HardConstraintConstPtr macrostate_constraint(string const &) const;
+
+	/// @brief Return the positions that have to be mutated together for every 
+	/// base pair in every macrostate to be able to form.  The graph is compiled 
+	/// the first time it's needed, and shared with copies of this device.
+	PositionGraphConstPtr position_graph() const;
+
 	/// @brief Return the context that this device is operating in.
 	ContextConstPtr context() const;
 
@@ -61,22 +109,48 @@ public:
 	/// @brief Simulate this device by itself, without context.
 	void remove_context();
 
-	/// @brief Make a point mutation in this device.
+	/// @brief Make a point mutation in this device.  Every mutation that 
+	/// changes the sequence is recorded, so that it can be undone.
 	void mutate(int, char const);
 
+	/// @brief Return the mutations made since the log was last cleared, in the 
+	/// order they were made.
+	MutationLog const &mutations() const;
+
+	/// @brief Revert every mutation in the log, then clear the log.
+	void undo_mutations();
+
+	/// @brief Clear the log without reverting anything.
+	void forget_mutations();
+
+	/// @brief Make the given mutations (e.g. the log from another device with 
+	/// the same sequence) without recording them.
+	void replay_mutations(MutationLog const &);
+
 	/// @brief Return a deep-copy of this device.
 	DevicePtr copy() const;
 
 	/// @brief Make this device equivalent to the given one.
 	void assign(DevicePtr);
 
+	/// @brief Return a hash of the sequence, macrostates, and context of this 
+	/// device.
+	size_t hash() const;
+
+	/// @brief Return true if the given device has the same sequence, 
+	/// macrostates, and context as this one.
+	bool operator==(Device const &) const;
+
+	/// @brief Return true if the given device differs from this one.
+	bool operator!=(Device const &) const;
+
 public:
 
 	/// @brief
 	class macrostate_iterator :
 		public std::iterator<std::forward_iterator_tag, std::pair<string,string> > {
 
-	using internal_iterator = unordered_map<string,string>::const_iterator;
+	using internal_iterator = vector<std::pair<string,string>>::const_iterator;
 	internal_iterator my_it;
 	Device const &my_device;
 
@@ -95,18 +169,172 @@ public:
 	Device const &my_device;
 	public:
 		macrostate_view(Device const &dev): my_device(dev) {}
-		macrostate_iterator begin() { return macrostate_iterator(my_device, my_device.my_macrostates.begin()); }
-		macrostate_iterator end() { return macrostate_iterator(my_device, my_device.my_macrostates.end()); }
+		macrostate_iterator begin();
+		macrostate_iterator end();
 	};
 
 	/// @brief Return all the macrostates associated with this device.
 	macrostate_view macrostates() const;
 
-public:
+private:
 
-	string my_seq;
-	unordered_map<string,string> my_macrostates;
+	/// @brief Return the nucleotide at the given (normalized) position, 
+	/// neglecting the current context.
+	char get(int) const;
+
+	/// @brief Set the nucleotide at the given (normalized) position, neglecting 
+	/// the current context.
+	void set(int, char);
+
+private:
+
+	int my_len;
+	vector<uint64_t> my_bases;
+	vector<uint64_t> my_mutable;
+	vector<std::pair<int,char>> my_exceptions;
+	MacrostateTableConstPtr my_macrostates;
 	ContextConstPtr my_context;
+	MutationLog my_mutations;
+	mutable PositionGraphConstPtr my_position_graph;
+
+};
+
+/// @brief The macrostates of a device, i.e. named constraints on how it should 
+/// fold, in order of name.
+///
+/// @details Tables are immutable, so they can be shared by every copy of a 
+/// device.  Adding a macrostate to a device makes a new table.
+class MacrostateTable {
+
+public:
+
+	using value_type = std::pair<string,string>;
+	using const_iterator = vector<value_type>::const_iterator;
+
+	/// @brief Make an empty table.
+	MacrostateTable();
+
+	/// @brief Make a copy of the given table with the given macrostate added, 
+	/// or replaced if it's already in the table.
+	MacrostateTable(MacrostateTable const &, string, string);
+
+	/// @brief Return the constraints for the given macrostate, or nullptr if 
+	/// there is no such macrostate.
+	string const *find(string const &) const;
+
+	/// @brief Return the number of macrostates in this table.
+	int size() const;
+
+	/// @brief Return an iterator to the first macrostate.
+	const_iterator begin() const;
+
+	/// @brief Return an iterator past the last macrostate.
+	const_iterator end() const;
+
+	/// @brief Return a hash of every macrostate in this table.
+	size_t hash() const;
+
+	/// @brief Return true if the given table has the same macrostates.
+	bool operator==(MacrostateTable const &) const;
+
+	/// @brief Return the given macrostate, padded for a context with the given 
+	/// number of nucleotides before and after the device, and compiled into 
+	/// hard constraints.  Return nullptr if there is no such macrostate.  This 
+	/// is thread-safe.
+	HardConstraintConstPtr constraint(string const &, int, int) const;
+
+private:
+
+	vector<value_type> my_macrostates;
+	size_t my_hash;
+
+	// Compiled constraints are keyed by the index of the macrostate and the 
+	// lengths of the context on either side of the device.
+	using ConstraintKey = std::tuple<int,int,int>;
+	mutable map<ConstraintKey, HardConstraintConstPtr> my_constraints;
+	mutable std::mutex my_constraints_mutex;
+
+};
+
+/// @brief A macrostate constraint in dot-bracket notation, compiled into the 
+/// list of base pairs and unpaired positions that it enforces.
+///
+/// @details Only the symbols used to define macrostates ('.', 'x', '(', and 
+/// ')') are compiled.  Constraints with any other symbols have to be given to 
+/// the folding engine as dot-bracket strings instead (see is_compiled()).
+class HardConstraint {
+
+public:
+
+	/// @brief A single base pair (if j > 0) or unpaired position (if j == 0), 
+	/// using the 1-indexed positions that ViennaRNA expects.
+	struct Operation {
+		int i, j;
+	};
+
+	/// @brief Compile the given dot-bracket constraint.
+	HardConstraint(string const &);
+
+	/// @brief Return the constraint in dot-bracket notation.
+	string const &dot_bracket() const;
+
+	/// @brief Return false if the constraint contains symbols that weren't 
+	/// compiled, and has to be applied from its dot-bracket string.
+	bool is_compiled() const;
+
+	/// @brief Return the base pairs and unpaired positions enforced by this 
+	/// constraint, in the order they appear in the dot-bracket string.
+	vector<Operation> const &operations() const;
+
+private:
+
+	string my_dot_bracket;
+	bool my_compiled;
+	vector<Operation> my_operations;
+
+};
+
+/// @brief The positions in a device that have to be mutated together, so that 
+/// every base pair in every macrostate can still form.
+///
+/// @details Positions are linked if they're base-paired to each other in any 
+/// macrostate.  Each group of linked positions is 2-colored, such that linked 
+/// positions always have different colors.  Mutating one position means giving 
+/// every position of the same color the same base, and every position of the 
+/// other color the complementary base.  Positions are indexed without regard 
+/// to context, and mutability is taken from the case of the sequence at the 
+/// time the graph is compiled.
+class PositionGraph {
+
+public:
+
+	/// @brief Compile the macrostates of the given device.  Throw if any 
+	/// macrostate has mismatched parentheses, if any mutable position is 
+	/// base-paired to an immutable one, or if the base pairs from different 
+	/// macrostates can't all be satisfied at once.
+	PositionGraph(Device const &);
+
+	/// @brief Return true if the given position can be mutated.
+	bool is_mutable(int) const;
+
+	/// @brief Return the mutable positions that aren't constrained to be the 3' 
+	/// end of a base pair, in order.  These are the positions that moves should 
+	/// choose from, since the 3' ends are mutated along with their partners.
+	vector<int> const &free_positions() const;
+
+	/// @brief Return every position linked to the given one, including itself.
+	vector<int> const &component(int) const;
+
+	/// @brief Return true if the given positions need to be complementary, or 
+	/// false if they need to be the same.  The positions must be linked.
+	bool complementary(int, int) const;
+
+private:
+
+	vector<int> my_free_positions;
+	vector<int> my_component_ids;
+	vector<bool> my_colors;
+	vector<vector<int>> my_components;
 
 };
 
@@ -144,10 +372,10 @@ public:
 	Context(string="", string="");
 
 	/// @brief Return the sequence that will be 5' of the device.
-	string before() const;
+	string const &before() const;
 
 	/// @brief Return the sequence that will be 3' of the device.
-	string after() const;
+	string const &after() const;
 
 private:
 	string my_before;
@@ -156,4 +384,15 @@ private:
 };
 
 
+}
+
+namespace std {
+
+template<>
+struct hash<addapt::Device> {
+	size_t operator()(addapt::Device const &device) const {
+		return device.hash();
+	}
+};
+
 }
@@ -1,9 +1,11 @@
 #pragma once
 
+#include <atomic>
 #include <iostream>
 #include <fstream>
 #include <map>
 #include <memory>
+#include <random>
 #include <vector>
 
 #include "model.hh"
@@ -15,6 +17,20 @@ namespace addapt {
 class MonteCarlo;
 using MonteCarloPtr = std::shared_ptr<MonteCarlo>;
 
+struct MonteCarloStep;
+
+class ReplicaExchange;
+using ReplicaExchangePtr = std::shared_ptr<ReplicaExchange>;
+
+class SteepestDescent;
+using SteepestDescentPtr = std::shared_ptr<SteepestDescent>;
+
+class GeneticAlgorithm;
+using GeneticAlgorithmPtr = std::shared_ptr<GeneticAlgorithm>;
+
+class PopulationAnnealing;
+using PopulationAnnealingPtr = std::shared_ptr<PopulationAnnealing>;
+
 class Move;
 using MovePtr = std::shared_ptr<Move>;
 using MoveList = std::vector<MovePtr>;
@@ -26,6 +42,17 @@ class Reporter;
 using ReporterPtr = std::shared_ptr<Reporter>;
 using ReporterList = std::vector<ReporterPtr>;
 
+/// @brief Counters describing how many moves were rejected by the surrogate 
+/// score function without being scored exactly, and how many speculative 
+/// proposals were scored but never considered.
+struct MonteCarloCounters {
+	long prescreened = 0;
+	long prescreen_rejections = 0;
+	long prescreen_pf_calls_saved = 0;
+	long speculative_proposals = 0;
+	long speculative_proposals_discarded = 0;
+};
+
 class MonteCarlo {
 
 public:
@@ -33,9 +60,20 @@ public:
 	/// @brief Default deviceor.
 	MonteCarlo();
 
-	/// @brief Perform the Monte Carlo design simulation.
+	/// @brief Perform the Monte Carlo design simulation.  The given device is 
+	/// not modified; the final device is returned.
 	DevicePtr apply(DevicePtr, std::mt19937 &) const;
 
+	/// @brief Score the given device and prepare the reporters, so that the 
+	/// simulation can be run one move at a time with iterate().
+	void start(MonteCarloStep &, DevicePtr, std::mt19937 &) const;
+
+	/// @brief Propose one move, then accept or reject it.
+	void iterate(MonteCarloStep &, std::mt19937 &) const;
+
+	/// @brief Give the reporters a chance to wrap up.
+	void finish(MonteCarloStep &) const;
+
 	/// @brief Return the number of moves that will be tried during the 
 	/// simulation.
 	int num_steps() const;
@@ -43,6 +81,42 @@ public:
 	/// @brief Set the number of moves that will be tried during the simulation.
 	void num_steps(int);
 
+	/// @brief Return true if proposed moves will be rejected as soon as it's 
+	/// clear they can't satisfy the Metropolis criterion.
+	bool early_rejection() const;
+
+	/// @brief Specify whether or not proposed moves should be rejected as soon 
+	/// as it's clear they can't satisfy the Metropolis criterion.  This draws 
+	/// the random threshold before scoring each move, and stops scoring once the 
+	/// best score the move could get is below that threshold.  Every score term 
+	/// must have an upper bound (see ScoreTerm::max_value()) for this to save 
+	/// any time.  Moves that are rejected early are left unscored (the proposed 
+	/// score and the score difference are NaN), so reporters write them without 
+	/// any scores and thermostats don't learn from them.  The same moves are 
+	/// accepted either way, unless the thermostat adapts to the scores.
+	void early_rejection(bool);
+
+	/// @brief Return the number of moves that are proposed and scored at once.
+	int speculation() const;
+
+	/// @brief Propose and score the given number of moves at once, then 
+	/// consider them one step at a time.
+	///
+	/// @details Every proposal is made from the current device, and all of 
+	/// them are scored together by ScoreFunction::evaluate_many(), which can 
+	/// spread the folding across every thread the score function is allowed 
+	/// to use.  The proposals are then considered in the order they were made, 
+	/// each as its own step with its own Metropolis test.  Rejected proposals 
+	/// don't change the current device, so the proposals after them are still 
+	/// valid.  Once a proposal is accepted, the rest are discarded.  This is 
+	/// the same Markov chain as without speculation, and the trajectory only 
+	/// depends on the random seed and the number of proposals, but the extra 
+	/// proposals use up random numbers, so the trajectory changes with the 
+	/// number of proposals.  Speculation is most useful at low temperature, 
+	/// where most moves are rejected.  Early rejection has no effect on 
+	/// speculative proposals, and delayed acceptance can't be used with them.
+	void speculation(int);
+
 	/// @brief Return the object responsible for setting the "temperature" of the 
 	/// Metropolis criterion.
 	ThermostatPtr thermostat() const;
@@ -57,6 +131,28 @@ public:
 	/// @brief Set the score function.
 	void scorefxn(ScoreFunctionPtr);
 
+	/// @brief Return the cheap score function used to prescreen moves, or 
+	/// nullptr if moves aren't prescreened.
+	ScoreFunctionPtr surrogate_scorefxn() const;
+
+	/// @brief Prescreen every move with the given cheap score function (e.g. 
+	/// from ScoreFunction::surrogate()) before scoring it exactly, or pass 
+	/// nullptr to score every move exactly.
+	///
+	/// @details This is delayed-acceptance Metropolis (Christen and Fox, 2005).  
+	/// Each move is first accepted with probability min(1, exp(ΔS*/T)), where 
+	/// S* is the surrogate score.  Only moves that pass are scored exactly, and 
+	/// they're then accepted with probability min(1, exp((ΔS - ΔS*)/T)).  The 
+	/// second test corrects for the first, so the simulation samples exactly 
+	/// the same distribution as it would without prescreening, but the 
+	/// trajectory itself is different.
+	void surrogate_scorefxn(ScoreFunctionPtr);
+
+	/// @brief Return the number of moves that have been prescreened and 
+	/// rejected by the surrogate score function, and the number of speculative 
+	/// proposals that have been made and discarded.
+	MonteCarloCounters counters() const;
+
 	/// @brief Return the list of possible moves.
 	MoveList moves() const;
 
@@ -75,13 +171,31 @@ public:
 	/// @brief Add a reporter.
 	void operator+=(ReporterPtr);
 
+	private:
+
+		/// @brief Score every option given by a heat-bath move, pick one by its 
+		/// Boltzmann weight, and make the same mutations to the proposed device.
+		void choose_heat_bath_option(
+				MonteCarloStep &, vector<DevicePtr> const &) const;
+
+		/// @brief Make and score the next batch of speculative proposals.
+		void speculate(MonteCarloStep &, std::mt19937 &) const;
+
 	private:
 
 		int my_steps;
+		bool my_early_rejection;
+		int my_speculation;
 		ThermostatPtr my_thermostat;
 		ScoreFunctionPtr my_scorefxn;
+		ScoreFunctionPtr my_surrogate_scorefxn;
 		MoveList my_moves;
 		ReporterList my_reporters;
+		mutable std::atomic<long> my_prescreened;
+		mutable std::atomic<long> my_prescreen_rejections;
+		mutable std::atomic<long> my_prescreen_pf_calls_saved;
+		mutable std::atomic<long> my_speculative_proposals;
+		mutable std::atomic<long> my_speculative_proposals_discarded;
 
 	};
 
@@ -94,13 +208,421 @@ enum class OutcomeEnum {
 
 struct MonteCarloStep {
 	int i, num_steps;
+
+	// The simulation works on its own copies of the starting device.  Between 
+	// steps, the proposed device is always the same as the current one.
 	DevicePtr current_device, proposed_device;
 	MovePtr move;
 	EvaluatedScoreFunction score_table;
 	double current_score, proposed_score, score_diff;
 	double temperature, metropolis_criterion, random_threshold;
 	OutcomeEnum outcome;
+
+	// Only used for delayed acceptance.  Moves rejected by the surrogate aren't 
+	// scored exactly, so the proposed score and the score difference are NaN 
+	// for those moves.
+	EvaluatedScoreFunction surrogate_table;
+	double current_surrogate_score, proposed_surrogate_score;
+	bool prescreen_rejected;
+
+	// Only used for speculative proposals.  Each batch of proposals is scored 
+	// at once, then used up one step at a time.
+	vector<DevicePtr> speculative_devices;
+	vector<MovePtr> speculative_moves;
+	vector<EvaluatedScoreFunction> speculative_tables;
+	vector<double> speculative_scores;
+	int next_speculation;
+
 	std::map<OutcomeEnum,int> outcome_counters;
+
+	// Moves and Metropolis thresholds are drawn from their own copies of the 
+	// random number generator, separate from the one the moves themselves use.
+	std::mt19937 move_rng, threshold_rng;
+};
+
+/// @brief Run several Monte Carlo simulations in parallel, and periodically 
+/// try to swap devices between simulations at neighboring temperatures.
+///
+/// @details Each replica is an ordinary MonteCarlo object with its own 
+/// thermostat and reporters, so replicas should not share thermostats or 
+/// reporters.  They can (and usually should) share moves and score functions.  
+/// Replicas should be added in order of increasing temperature.  Swaps are 
+/// accepted with probability min(1, exp((S₂ - S₁)(1/T₁ - 1/T₂))), which 
+/// preserves the equilibrium distribution of every replica.
+class ReplicaExchange {
+
+public:
+
+	/// @brief Default constructor.
+	ReplicaExchange();
+
+	/// @brief Perform the simulations, starting every replica from a copy of 
+	/// the given device.  Return the final device from the first (i.e. 
+	/// coldest) replica.
+	DevicePtr apply(DevicePtr, std::mt19937 &);
+
+	/// @brief Return the replicas, in order of increasing temperature.
+	vector<MonteCarloPtr> replicas() const;
+
+	/// @brief Add a replica.  Replicas should be added in order of increasing 
+	/// temperature.
+	void add_replica(MonteCarloPtr);
+
+	/// @brief Add a replica.
+	void operator+=(MonteCarloPtr);
+
+	/// @brief Return the number of steps between attempted swaps.
+	int swap_interval() const;
+
+	/// @brief Set the number of steps between attempted swaps.
+	void swap_interval(int);
+
+	/// @brief Return the number of threads used to run the replicas.
+	int num_threads() const;
+
+	/// @brief Set the number of threads used to run the replicas.
+	void num_threads(int);
+
+	/// @brief Return the fraction of attempted swaps that were accepted between 
+	/// each pair of neighboring replicas, as of the last simulation.
+	vector<double> swap_acceptance_rates() const;
+
+private:
+
+	/// @brief Try to swap devices between neighboring replicas.  Only even (or 
+	/// odd) pairs are attempted at once, so that each replica is involved in at 
+	/// most one swap.
+	void attempt_swaps(vector<MonteCarloStep> &, int, std::mt19937 &);
+
+private:
+
+	vector<MonteCarloPtr> my_replicas;
+	int my_swap_interval;
+	int my_num_threads;
+	vector<int> my_swap_attempts;
+	vector<int> my_swap_accepts;
+
+};
+
+/// @brief Counters describing how many neighbors were scored by a steepest 
+/// descent, and how many scores were reused from earlier steps.
+struct SteepestDescentCounters {
+	long neighbors_scored = 0;
+	long neighbors_reused = 0;
+};
+
+/// @brief Repeatedly make the single mutation that improves the score the 
+/// most, until no mutation improves it.
+///
+/// @details The neighbors of a device are every sequence that can be reached 
+/// by mutating one free position (see PositionGraph::free_positions()) to one 
+/// of the three other bases, along with the positions linked to it.  Every 
+/// neighbor is scored at once by ScoreFunction::evaluate_many(), so the 
+/// folding is spread across every thread the score function can use.  
+/// Neighbors that were already scored in an earlier step (e.g. the device the 
+/// descent just came from) aren't scored again.  Ties go to whichever 
+/// neighbor comes first, so the descent is deterministic.  Each step of the 
+/// descent is given to the reporters as an accepted MonteCarloStep at zero 
+/// temperature, so the path can be written in the same format as a 
+/// trajectory.  The last step records the best neighbor of the local optimum 
+/// as a rejected move.  If the number of steps isn't limited, the reporters 
+/// are told how many steps have been taken so far (including the current 
+/// one) in place of the total number of steps.
+class SteepestDescent {
+
+public:
+
+	/// @brief Default constructor.
+	SteepestDescent();
+
+	/// @brief Descend from a copy of the given device, and return the local 
+	/// optimum (or wherever the descent was after the maximum number of steps).
+	DevicePtr apply(DevicePtr) const;
+
+	/// @brief Return the maximum number of mutations to make.  By default, 
+	/// there's no limit.
+	int max_steps() const;
+
+	/// @brief Set the maximum number of mutations to make.
+	void max_steps(int);
+
+	/// @brief Return the score function being optimized.
+	ScoreFunctionPtr scorefxn() const;
+
+	/// @brief Set the score function being optimized.
+	void scorefxn(ScoreFunctionPtr);
+
+	/// @brief Return the number of neighbors that have been scored, and the 
+	/// number whose scores were reused.
+	SteepestDescentCounters counters() const;
+
+	/// @brief Return the reporters that will see each step of the descent.
+	ReporterList reporters() const;
+
+	/// @brief Add a reporter that will see each step of the descent.
+	void add_reporter(ReporterPtr);
+
+	/// @brief Add a reporter that will see each step of the descent.
+	void operator+=(ReporterPtr);
+
+	private:
+
+		int my_max_steps;
+		ScoreFunctionPtr my_scorefxn;
+		ReporterList my_reporters;
+		mutable std::atomic<long> my_neighbors_scored;
+		mutable std::atomic<long> my_neighbors_reused;
+
+};
+
+/// @brief Statistics describing one generation of a genetic algorithm.
+struct GenerationStats {
+	double best_score = 0;
+	double mean_score = 0;
+
+	/// @brief The mean fraction of positions that differ between two members 
+	/// of the population.
+	double diversity = 0;
+
+	/// @brief The number of new devices that were scored, and how long it took 
+	/// to make and score them (in seconds).
+	int num_scored = 0;
+	double seconds = 0;
+};
+
+/// @brief Evolve a population of devices by selection, crossover, and 
+/// mutation.
+///
+/// @details Each generation starts with the best members of the previous one 
+/// (the elites), unchanged.  The rest of the generation is made by picking 
+/// parents by tournament selection, crossing them over (with some 
+/// probability), and mutating the children with a randomly chosen move (also 
+/// with some probability).  Crossover copies each group of linked positions 
+/// (see PositionGraph::component()) from one parent or the other as a whole, 
+/// so every base pair that could form in the parents can still form in the 
+/// children.  The new members of each generation are scored together by 
+/// ScoreFunction::evaluate_many(), so the folding can be spread across every 
+/// thread the score function can use.  Each generation is given to the 
+/// reporters as a MonteCarloStep at zero temperature, with the best device 
+/// found so far as the current device, so the progress can be written in the 
+/// same format as a trajectory.  Everything is drawn from the given random 
+/// number generator in a fixed order, so the results only depend on the seed.
+class GeneticAlgorithm {
+
+public:
+
+	/// @brief Default constructor.
+	GeneticAlgorithm();
+
+	/// @brief Evolve a population started from the given device, and return the 
+	/// best device found.  The given device is not modified.
+	DevicePtr apply(DevicePtr, std::mt19937 &);
+
+	/// @brief Return the number of generations to evolve.
+	int num_generations() const;
+
+	/// @brief Set the number of generations to evolve.
+	void num_generations(int);
+
+	/// @brief Return the number of devices in each generation.
+	int population_size() const;
+
+	/// @brief Set the number of devices in each generation.
+	void population_size(int);
+
+	/// @brief Return the number of devices that compete to be each parent.
+	int tournament_size() const;
+
+	/// @brief Set the number of devices that compete to be each parent.  Bigger 
+	/// tournaments mean stronger selection.
+	void tournament_size(int);
+
+	/// @brief Return the number of devices carried over unchanged from each 
+	/// generation to the next.
+	int num_elites() const;
+
+	/// @brief Set the number of devices carried over unchanged from each 
+	/// generation to the next.
+	void num_elites(int);
+
+	/// @brief Return the probability that each child is made by crossing over 
+	/// two parents, rather than by copying one.
+	double crossover_rate() const;
+
+	/// @brief Set the probability that each child is made by crossing over two 
+	/// parents, rather than by copying one.
+	void crossover_rate(double);
+
+	/// @brief Return the probability that each child is mutated.
+	double mutation_rate() const;
+
+	/// @brief Set the probability that each child is mutated.
+	void mutation_rate(double);
+
+	/// @brief Return the score function being optimized.
+	ScoreFunctionPtr scorefxn() const;
+
+	/// @brief Set the score function being optimized.
+	void scorefxn(ScoreFunctionPtr);
+
+	/// @brief Return the moves used to mutate children.
+	MoveList moves() const;
+
+	/// @brief Add a move used to mutate children.
+	void add_move(MovePtr);
+
+	/// @brief Add a move used to mutate children.
+	void operator+=(MovePtr);
+
+	/// @brief Return the reporters that will see each generation.
+	ReporterList reporters() const;
+
+	/// @brief Add a reporter that will see each generation.
+	void add_reporter(ReporterPtr);
+
+	/// @brief Add a reporter that will see each generation.
+	void operator+=(ReporterPtr);
+
+	/// @brief Return statistics for every generation of the last run, starting 
+	/// with the initial population.
+	vector<GenerationStats> const &generation_stats() const;
+
+	private:
+
+		/// @brief Return a copy of the given device with each group of linked 
+		/// positions copied from one parent or the other at random.
+		DevicePtr crossover(
+				DeviceConstPtr, DeviceConstPtr, std::mt19937 &) const;
+
+	private:
+
+		int my_num_generations;
+		int my_population_size;
+		int my_tournament_size;
+		int my_num_elites;
+		double my_crossover_rate;
+		double my_mutation_rate;
+		ScoreFunctionPtr my_scorefxn;
+		MoveList my_moves;
+		ReporterList my_reporters;
+		vector<GenerationStats> my_generation_stats;
+
+};
+
+/// @brief Statistics describing one temperature of a population annealing 
+/// simulation, as of the end of the moves made at that temperature.
+struct AnnealingStats {
+	double temperature = 0;
+	double best_score = 0;
+	double mean_score = 0;
+
+	/// @brief The dimensionless free energy, -ln(Z(T) / Z(T₀)), relative to 
+	/// the first temperature.  Z(T) is the sum of exp(S/T) over every sequence.
+	double free_energy = 0;
+
+	/// @brief The effective number of walkers after reweighting for this 
+	/// temperature, i.e. (Σw)² / Σw².  If this is a small fraction of the 
+	/// population, the temperature steps are too big (or the population too 
+	/// small) for the results to be trusted.
+	double effective_size = 0;
+
+	/// @brief The number of walkers from the first temperature that still have 
+	/// descendants in the population.
+	int num_families = 0;
+};
+
+/// @brief Anneal a population of walkers through a shared temperature 
+/// schedule, resampling the walkers by their Boltzmann weights at each step.
+///
+/// @details Every walker starts as a copy of the given device, and makes a 
+/// few Monte Carlo moves at each temperature.  Before moving to the next 
+/// temperature, walker i is given the weight wᵢ = exp(Sᵢ(1/T' - 1/T)), and 
+/// the population is resampled so that each walker is copied in proportion to 
+/// its weight.  Walkers stuck in poor basins are dropped, and those in good 
+/// basins multiply, so the population stays near equilibrium at every 
+/// temperature.  The mean weight gives the ratio of the partition functions 
+/// at the two temperatures, which is accumulated into a free energy estimate 
+/// (see AnnealingStats).  The walkers are moved in parallel.  Each walker has 
+/// its own random number generators, which are reseeded in order from the 
+/// given generator after every resampling step, so the results don't depend 
+/// on the number of threads.  Each temperature is given to the reporters as a 
+/// MonteCarloStep describing the best walker, so the progress can be written 
+/// in the same format as a trajectory.
+class PopulationAnnealing {
+
+public:
+
+	/// @brief Default constructor.
+	PopulationAnnealing();
+
+	/// @brief Anneal a population started from the given device, and return 
+	/// the best device in the final population.  The given device is not 
+	/// modified.
+	DevicePtr apply(DevicePtr, std::mt19937 &);
+
+	/// @brief Return the temperatures, in the order they'll be visited.
+	vector<double> temperatures() const;
+
+	/// @brief Set the temperatures, in the order they'll be visited (i.e. 
+	/// usually decreasing).  Every temperature must be positive.
+	void temperatures(vector<double>);
+
+	/// @brief Return the number of walkers.
+	int population_size() const;
+
+	/// @brief Set the number of walkers.
+	void population_size(int);
+
+	/// @brief Return the number of moves each walker makes at each temperature.
+	int steps_per_temperature() const;
+
+	/// @brief Set the number of moves each walker makes at each temperature.
+	void steps_per_temperature(int);
+
+	/// @brief Return the number of threads used to move the walkers.
+	int num_threads() const;
+
+	/// @brief Set the number of threads used to move the walkers.
+	void num_threads(int);
+
+	/// @brief Return the score function being optimized.
+	ScoreFunctionPtr scorefxn() const;
+
+	/// @brief Set the score function being optimized.
+	void scorefxn(ScoreFunctionPtr);
+
+	/// @brief Return the moves made by each walker.
+	MoveList moves() const;
+
+	/// @brief Add a move made by each walker.
+	void add_move(MovePtr);
+
+	/// @brief Add a move made by each walker.
+	void operator+=(MovePtr);
+
+	/// @brief Return the reporters that will see each temperature.
+	ReporterList reporters() const;
+
+	/// @brief Add a reporter that will see each temperature.
+	void add_reporter(ReporterPtr);
+
+	/// @brief Add a reporter that will see each temperature.
+	void operator+=(ReporterPtr);
+
+	/// @brief Return statistics for every temperature of the last run.
+	vector<AnnealingStats> const &annealing_stats() const;
+
+	private:
+
+		vector<double> my_temperatures;
+		int my_population_size;
+		int my_steps_per_temperature;
+		int my_num_threads;
+		ScoreFunctionPtr my_scorefxn;
+		MoveList my_moves;
+		ReporterList my_reporters;
+		vector<AnnealingStats> my_annealing_stats;
+
 };
 
 
@@ -119,7 +641,14 @@ mutate_recursively(DevicePtr, int const, char const);
 void
 mutate_recursively(DevicePtr, int const, char const, vector<bool> &);
 
+/// @brief Mutate the given position, and make the same or complementary 
+/// mutations to every position linked to it by the device's position graph.
+void
+mutate_linked_positions(DevicePtr, int const, char const);
+
 
+/// @details Moves should only change devices via Device::mutate(), so that 
+/// MonteCarlo can undo rejected moves.
 class Move {
 
 public:
@@ -128,6 +657,15 @@ public:
 
 	virtual void apply(DevicePtr, std::mt19937 &) const = 0;
 
+	/// @brief Return every device that this move could lead to from the given 
+	/// one, if MonteCarlo should score them all and pick one by its Boltzmann 
+	/// weight (i.e. a heat-bath move).  Return an empty list (the default) if 
+	/// the move should be applied and accepted by the Metropolis criterion.  
+	/// The options should only differ from the given device by calls to 
+	/// Device::mutate().
+	virtual vector<DevicePtr> heat_bath_options(
+			DeviceConstPtr, std::mt19937 &) const { return {}; }
+
 };
 
 class UnbiasedMutationMove : public Move {
@@ -142,6 +680,57 @@ public:
 
 };
 
+/// @brief Pick a random free position, and let MonteCarlo choose between all 
+/// four bases at that position (along with the positions linked to it) by 
+/// their Boltzmann weights.
+///
+/// @details The options are scored together by 
+/// ScoreFunction::evaluate_many(), so the score function can fold them on 
+/// separate threads.  The option matching the current device is already 
+/// scored, so only three devices need to be folded per step.  The choice 
+/// samples the right distribution by itself, so it's always accepted.  When 
+/// the move is applied directly (e.g. by speculative proposals), it mutates a 
+/// random free position to a random base, just like UnbiasedMutationMove.
+class HeatBathMove : public Move {
+
+public:
+
+	HeatBathMove();
+
+	string name() const { return "HeatBath"; }
+
+	void apply(DevicePtr, std::mt19937 &) const;
+
+	vector<DevicePtr> heat_bath_options(DeviceConstPtr, std::mt19937 &) const;
+
+};
+
+/// @brief Always make the same mutation (along with the positions linked to 
+/// it), e.g. to enumerate the neighbors of a device.
+class PointMutationMove : public Move {
+
+public:
+
+	/// @brief Specify the position to mutate, and the base to mutate it to.
+	PointMutationMove(int, char);
+
+	string name() const { return "PointMutation"; }
+
+	void apply(DevicePtr, std::mt19937 &) const;
+
+	/// @brief Return the position that will be mutated.
+	int position() const;
+
+	/// @brief Return the base that position will be mutated to.
+	char base() const;
+
+private:
+
+	int my_position;
+	char my_base;
+
+};
+
 
 class Thermostat {
 
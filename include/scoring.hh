@@ -1,13 +1,18 @@
 #pragma once
 
+#include <atomic>
 #include <iostream>
 #include <memory>
 #include <vector>
 #include <list>
+#include <mutex>
+#include <tuple>
 
 #include <boost/multi_index_container.hpp>
 #include <boost/multi_index/random_access_index.hpp>
+#include <boost/multi_index/sequenced_index.hpp>
 #include <boost/multi_index/hashed_index.hpp>
+#include <boost/multi_index/member.hpp>
 #include <boost/multi_index/mem_fun.hpp>
 
 extern "C" {
@@ -21,13 +26,23 @@ namespace addapt {
 class ScoreFunction;
 using ScoreFunctionPtr = std::shared_ptr<ScoreFunction>;
 
- struct EvaluatedScoreTerm { string name; double weight, term; };
-using EvaluatedScoreFunction = std::vector<EvaluatedScoreTerm>;
+struct ScoreSchema;
+using ScoreSchemaConstPtr = std::shared_ptr<ScoreSchema const>;
+
+struct EvaluatedScoreFunction;
+
+class ScoreCache;
+using ScoreCachePtr = std::shared_ptr<ScoreCache>;
 
 class ScoreTerm;
 using ScoreTermPtr = std::shared_ptr<ScoreTerm>;
 using ScoreTermList = std::vector<ScoreTermPtr>;
 
+struct FoldRequest;
+using FoldRequestList = std::vector<FoldRequest>;
+
+class FoldPlan;
+
 enum class ConditionEnum {
 	APO,
 	HOLO,
@@ -38,6 +53,11 @@ enum class FavorableEnum {
 	YES,
 };
 
+enum class EvictionEnum {
+	LRU,
+	FIFO,
+};
+
 /// @brief The interface to RNA secondary structure predictions.
 class RnaFold {
 
@@ -52,16 +72,202 @@ public:
 	/// constraint string.
 	virtual double macrostate_prob(string) const = 0;
 
+	/// @brief Return the probability that the device will fold into the given 
+	/// macrostate, defined by a compiled hard constraint.  By default, this 
+	/// just uses the dot-bracket form of the constraint.
+	virtual double macrostate_prob(HardConstraint const &) const;
+
+	/// @brief Estimate the probability that the device will fold into the 
+	/// given macrostate, using minimum free energies instead of partition 
+	/// functions.  The estimate only has to be cheap and roughly correlated 
+	/// with macrostate_prob().  By default, this returns macrostate_prob().
+	virtual double macrostate_mfe_prob(HardConstraint const &) const;
+
+};
+
+/// @brief Return whichever of the given apo and holo folding engines applies 
+/// to the given condition.
+RnaFold const &
+fold_for(ConditionEnum, RnaFold const &, RnaFold const &);
+
+/// @brief Counters describing how much partition function work has been done 
+/// by every folding engine in the process.
+struct RnaFoldCounters {
+	long pf_calls = 0;
+	long pf_calls_saved = 0;
+	long pf_calls_skipped = 0;
+	long mfe_calls = 0;
+	long peak_bytes = 0;
+};
+
+/// @brief Counters describing how often fold compounds have been allocated, 
+/// compared to how often they've been reused.
+struct FoldCompoundPoolCounters {
+	long allocations = 0;
+	long reuses = 0;
+	long bytes = 0;
+	long peak_bytes = 0;
+};
+
+/// @brief The model details and Boltzmann factors used by every fold compound, 
+/// derived once per process.
+///
+/// @details The temperature and energy model never change during a run, so 
+/// there's no reason for ViennaRNA to exponentiate the energy parameters again 
+/// every time a fold compound is allocated.  The shared parameters are never 
+/// modified once they've been derived, so they can be read from any thread.  
+/// Each fold compound gets its own copy, which ViennaRNA rescales for the 
+/// length of the sequence.
+class FoldParameters {
+
+public:
+
+	/// @brief Return the parameters shared by the whole process, deriving them 
+	/// the first time this is called.  This is thread-safe.
+	static FoldParameters const &shared();
+
+	/// @brief Free the shared parameters.
+	~FoldParameters();
+
+	/// @brief Return the model details for fold compounds that will (or won't) 
+	/// calculate base-pair probabilities.
+	vrna_md_t const &model_details(bool) const;
+
+	/// @brief Allocate a fold compound for the given sequence, using the shared 
+	/// Boltzmann factors instead of deriving new ones.  The fold compound will 
+	/// only be able to calculate base-pair probabilities if the second argument 
+	/// is true.
+	vrna_fold_compound_t *make_fold_compound(string const &, bool) const;
+
+private:
+
+	/// @brief Derive the parameters from ViennaRNA's defaults.
+	FoldParameters();
+
+private:
+
+	// Both arrays are indexed by whether or not base-pair probabilities will be 
+	// calculated.
+	vrna_md_t my_md[2];
+	vrna_exp_param_t *my_exp_params[2];
+
+};
+
+/// @brief A collection of ViennaRNA fold compounds that aren't currently being 
+/// used, and can be recycled instead of allocated from scratch.
+///
+/// @details Allocating a fold compound means allocating O(N²) dynamic 
+/// programming matrices and scaling energy parameters.  ViennaRNA doesn't 
+/// provide a supported way to change the sequence of an existing fold 
+/// compound, so fold compounds are only reused for the same sequence (e.g. for 
+/// the constrained and unconstrained partition functions of one device).  
+/// Only constraints are reset between uses.  This means that fold compounds 
+/// don't survive from one design step to the next: every mutation still 
+/// allocates new matrices.  Idle fold compounds for other sequences of the 
+/// same length are freed when a new one is allocated, since the old sequence 
+/// is unlikely to come back once it's been mutated.  Pools are not 
+/// thread-safe, so each thread has its own.
+class FoldCompoundPool {
+
+public:
+
+	/// @brief Free every fold compound in the pool.
+	~FoldCompoundPool();
+
+	/// @brief Return the pool belonging to the calling thread.
+	static FoldCompoundPool &local();
+
+	/// @brief Return a fold compound for the given sequence, with no hard or 
+	/// soft constraints.  The fold compound will only be able to calculate base 
+	/// pair probabilities if the second argument is true.
+	vrna_fold_compound_t *acquire(string const &, bool);
+
+	/// @brief Return the given fold compound to the pool, so it can be reused.
+	void release(vrna_fold_compound_t *);
+
+	/// @brief Free every fold compound in the pool.
+	void clear();
+
+	/// @brief Return the number of fold compounds in the pool.
+	int size() const;
+
+	/// @brief Return the number of fold compounds that have been allocated 
+	/// and reused by every pool in the process, and how much memory their DP 
+	/// matrices take up (including idle fold compounds).
+	static FoldCompoundPoolCounters counters();
+
+	/// @brief Reset the allocation counters to zero, and the peak memory to the 
+	/// memory currently allocated.
+	static void reset_counters();
+
+	/// @brief Estimate the memory used by the DP matrices of the given fold 
+	/// compound.  This is dominated by the O(N²) partition function matrices.
+	static long dp_bytes(vrna_fold_compound_t const *);
+
+private:
+
+	/// @brief Remove any hard or soft constraints from the given fold compound.
+	static void reset(vrna_fold_compound_t *);
+
+	/// @brief Free every idle fold compound that matches the given predicate.
+	template <typename Predicate>
+	void evict(Predicate);
+
+private:
+
+	// Fold compounds are keyed by the sequence and whether or not they can 
+	// calculate base-pair probabilities.
+	using Key = pair<string,bool>;
+	std::multimap<Key, vrna_fold_compound_t *> my_idle_fcs;
+
+	static std::atomic<long> our_allocations;
+	static std::atomic<long> our_reuses;
+	static std::atomic<long> our_bytes;
+	static std::atomic<long> our_peak_bytes;
+
+};
+
+/// @brief The DP memory held by a group of folding engines (e.g. every engine 
+/// used to score one device), and the most they've held at once.  Engines on 
+/// different threads can share a tracker.
+class DpMemoryTracker {
+
+public:
+
+	/// @brief Start with nothing held.
+	DpMemoryTracker();
+
+	/// @brief Record that the given number of bytes were acquired.
+	void acquire(long);
+
+	/// @brief Record that the given number of bytes were released.
+	void release(long);
+
+	/// @brief Return the number of bytes currently held.
+	long bytes() const;
+
+	/// @brief Return the most bytes that were ever held at once.
+	long peak_bytes() const;
+
+private:
+
+	std::atomic<long> my_bytes;
+	std::atomic<long> my_peak_bytes;
+
 };
 
 class ViennaRnaFold : public RnaFold {
 
 public:
 
-	/// @brief Predict how the device will fold.
-	ViennaRnaFold(DeviceConstPtr, AptamerConstPtr=nullptr);
+	/// @brief Predict how the device will fold.  If a tracker is given, the DP 
+	/// memory held by this engine is also recorded there.
+	ViennaRnaFold(
+			DeviceConstPtr,
+			AptamerConstPtr=nullptr,
+			DpMemoryTracker *memory=nullptr);
 
-	/// @brief Free the ViennaRNA data structures.
+	/// @brief Return the ViennaRNA data structures to the pool.
 	~ViennaRnaFold();
 
 	/// @brief Return the probability that these two nucleotides will base pair 
@@ -73,9 +279,68 @@ public:
 	/// constraint string.
 	double macrostate_prob(string) const;
 
+	/// @brief Return the probability that the device will fold into the given 
+	/// macrostate, defined by a compiled hard constraint.  This avoids having 
+	/// ViennaRNA parse the constraint every time.
+	double macrostate_prob(HardConstraint const &) const;
+
+	/// @brief Calculate the free energy (in kcal/mol) of the ensemble subject to 
+	/// the given constraint, or of the whole ensemble if the constraint is 
+	/// nullptr.  Also fill in kT (in kcal/mol).  Nothing is cached, and the fold 
+	/// compound goes back to the calling thread's pool right away, so this can 
+	/// be called from several threads at once.
+	double free_energy(HardConstraint const *, double &) const;
+
+	/// @brief Estimate the probability that the device will fold into the 
+	/// given macrostate by treating it as a two-state system: the lowest energy 
+	/// structure in the macrostate, and the lowest energy structure overall.  
+	/// The estimate is never more than 1/2, but it's always finite after taking 
+	/// the logarithm (unless the macrostate is impossible), and it only needs 
+	/// MFE calculations.
+	double macrostate_mfe_prob(HardConstraint const &) const;
+
+	/// @brief Calculate the minimum free energy (in kcal/mol) of the device 
+	/// subject to the given constraint, or without constraints if the 
+	/// constraint is nullptr.  Also fill in kT (in kcal/mol).  Like 
+	/// free_energy(), this can be called from several threads at once.
+	double min_free_energy(HardConstraint const *, double &) const;
+
+	/// @brief Return the number of partition functions that have been 
+	/// calculated by this engine.
+	int num_pf_calls() const;
+
+	/// @brief Return the number of partition functions (and MFE calculations) 
+	/// that have been calculated (and avoided) by every instance of this class, 
+	/// and the most DP memory any one instance has held at once.
+	static RnaFoldCounters counters();
+
+	/// @brief Record that the given number of partition functions were never 
+	/// calculated, because the score function gave up on the device early (see 
+	/// ScoreFunction::evaluate_or_reject()).
+	static void count_skipped_pf_calls(long);
+
+	/// @brief Reset the partition function counters to zero.
+	static void reset_counters();
+
 private:
 
-	vrna_fold_compound_t *make_fold_compound(bool) const;
+	/// @brief Get a fold compound for this device from the calling thread's 
+	/// pool, with the aptamer added if there is one.
+	vrna_fold_compound_t *acquire_fold_compound(bool) const;
+
+	/// @brief Return the given fold compound to the calling thread's pool.
+	void release_fold_compound(vrna_fold_compound_t *) const;
+
+	/// @brief Add the given constraint to the given fold compound.
+	static void add_constraint(vrna_fold_compound_t *, HardConstraint const &);
+
+	/// @brief Return the free energy of the whole ensemble (i.e. without any 
+	/// constraints) in kcal/mol.  This is only calculated once.
+	double ensemble_free_energy() const;
+
+	/// @brief Calculate the partition function and keep track of how many times 
+	/// this has been done.
+	double partition_function(vrna_fold_compound_t *) const;
 
 private:
 
@@ -86,12 +351,192 @@ private:
 	// that the pointer returned by c_str() is valid.
 	string my_seq;
 
-	// We need to store a list of all the fold compound data structures we end up 
-	// creating so we can deallocate them all.
-	mutable list<vrna_fold_compound_t *> my_fcs;
-
-	// We need a fold compound object to cache the base-pair probability matrix.
+	// We need a fold compound object to cache the base-pair probability matrix.  
+	// Every other fold compound is returned to the pool as soon as its 
+	// partition function has been calculated, so that no more than two sets of 
+	// DP matrices are ever held at once.
 	mutable vrna_fold_compound_t *my_bppm_fc;
+
+	// Keep track of the DP memory held by this engine.  These are atomic 
+	// because free_energy() can be called from several threads at once.
+	mutable std::atomic<long> my_bytes;
+	mutable std::atomic<int> my_pf_calls;
+	DpMemoryTracker *my_memory;
+
+	// The free energy of the unconstrained ensemble is the same for every 
+	// macrostate, so we only want to calculate it once.
+	mutable double my_g_tot;
+	mutable bool my_g_tot_cached;
+
+	// Likewise for the unconstrained minimum free energy.
+	mutable double my_g_mfe;
+	mutable bool my_g_mfe_cached;
+
+	static std::atomic<long> our_pf_calls;
+	static std::atomic<long> our_pf_calls_saved;
+	static std::atomic<long> our_pf_calls_skipped;
+	static std::atomic<long> our_mfe_calls;
+	static std::atomic<long> our_peak_bytes;
+};
+
+/// @brief A folding engine that answers from partition functions calculated 
+/// ahead of time (e.g. by a FoldPlan), and asks another engine about anything 
+/// else.
+class PrecomputedRnaFold : public RnaFold {
+
+public:
+
+	/// @brief Use the given engine for anything that wasn't precomputed.  The 
+	/// engine must outlive this object.
+	PrecomputedRnaFold(RnaFold const &);
+
+	/// @brief Remember the free energy of the ensemble subject to the given 
+	/// constraint, or of the whole ensemble if the constraint is nullptr.
+	void add_free_energy(HardConstraint const *, double, double);
+
+	/// @brief Ask the fallback engine.
+	double base_pair_prob(int, int) const;
+
+	/// @brief Ask the fallback engine.
+	double macrostate_prob(string) const;
+
+	/// @brief Return the probability that the device will fold into the given 
+	/// macrostate, using precomputed free energies if possible.
+	double macrostate_prob(HardConstraint const &) const;
+
+	/// @brief Ask the fallback engine.
+	double macrostate_mfe_prob(HardConstraint const &) const;
+
+private:
+
+	RnaFold const &my_fallback;
+	vector<pair<HardConstraint const *, double>> my_free_energies;
+	double my_g_tot;
+	double my_kT;
+	bool my_g_tot_known;
+
+};
+
+/// @brief A partition function that a score term will need, in the form of a 
+/// condition and the name of a macrostate.
+struct FoldRequest {
+	ConditionEnum condition;
+	string macrostate;
+};
+
+/// @brief The partition functions needed to score a batch of devices, merged 
+/// so that no partition function is calculated more than once.
+///
+/// @details Jobs are identified by the sequence being folded (including any 
+/// context), the aptamer (if any), and the constraint (if any).  Constraints 
+/// are compared by identity, which works because compiled constraints are 
+/// shared by every device with the same macrostates (see 
+/// Device::macrostate_constraint()).  Jobs are run longest-first on a 
+/// dynamically scheduled team of threads, so that the longest jobs don't end 
+/// up waiting for the others.
+class FoldPlan {
+
+public:
+
+	struct Job {
+		DeviceConstPtr device;
+		AptamerConstPtr aptamer;
+		HardConstraintConstPtr constraint;
+		string macrostate;
+		double free_energy = 0;
+		double kT = 0;
+		double seconds = 0;
+	};
+
+	/// @brief Default constructor.
+	FoldPlan();
+
+	/// @brief Ask for the free energy of the given device (which should already 
+	/// be in the right context) with the given aptamer (or nullptr) subject to 
+	/// the given constraint (or nullptr).  Return the index of the job that will 
+	/// calculate it, which may have been requested before.  The name of the 
+	/// macrostate is only used to label the job.
+	int request(
+			DeviceConstPtr, AptamerConstPtr, HardConstraintConstPtr,
+			string const &macrostate="");
+
+	/// @brief Calculate every job with the given number of threads.  If a 
+	/// tracker is given, the DP memory held by the jobs is recorded there.
+	void run(int, DpMemoryTracker *memory=nullptr);
+
+	/// @brief Return every job, in the order they were first requested.
+	vector<Job> const &jobs() const;
+
+	/// @brief Return the indices of the jobs in the order they'll be run, i.e. 
+	/// longest sequence first.
+	vector<int> order() const;
+
+	/// @brief Return the number of requests, including duplicates.
+	int num_requests() const;
+
+private:
+
+	using Key = std::tuple<string, Aptamer const *, HardConstraint const *>;
+
+	vector<Job> my_jobs;
+	map<Key, int> my_job_ids;
+	int my_num_requests;
+
+};
+
+/// @brief The layout of the score tables produced by a score function, which 
+/// has one row for every combination of context and score term.
+///
+/// @details Rows are grouped by context, so row `c * num_terms + t` holds the 
+/// value of term `t` in context `c`.  If the score function has no contexts, 
+/// there is a single unnamed context.  The schema is compiled whenever a term 
+/// or context is added to the score function, so the names and weights don't 
+/// have to be rebuilt every time a device is scored.
+struct ScoreSchema {
+	int num_terms = 0;
+	int num_contexts = 0;
+	vector<string> names;
+	vector<double> weights;
+	vector<int> term_ids;
+	vector<int> context_ids;
+	vector<string> context_names;
+
+	/// @brief Return the number of rows in the score table.
+	int size() const;
+
+	/// @brief Return the sum of the given term values, weighted by the schema.  
+	/// Each context is summed separately and the subtotals are added in order, 
+	/// so the result doesn't depend on how the values were calculated.
+	double weighted_sum(vector<double> const &) const;
+};
+
+/// @brief The value of every score term for a particular device, in the order 
+/// given by the schema.
+struct EvaluatedScoreFunction {
+	ScoreSchemaConstPtr schema;
+	vector<double> values;
+};
+
+/// @brief The total time spent on one kind of planned partition function.
+struct FoldTimings {
+	long jobs = 0;
+	double seconds = 0;
+};
+
+/// @brief Planned partition functions are timed separately for each condition 
+/// and macrostate.  Unconstrained partition functions have an empty macrostate 
+/// name.
+using FoldTimingsKey = pair<ConditionEnum,string>;
+
+/// @brief Counters describing how many score terms have been evaluated, and 
+/// how long the planned partition functions took.
+struct ScoreFunctionCounters {
+	long terms_evaluated = 0;
+	long terms_skipped = 0;
+	long fold_requests = 0;
+	long fold_jobs = 0;
+	map<FoldTimingsKey, FoldTimings> fold_timings;
+	long peak_bytes_per_evaluation = 0;
 };
 
 class ScoreFunction {
@@ -105,10 +550,50 @@ public:
 	double evaluate(DeviceConstPtr) const;
 
 	/// @brief Calculate a score for the given device and fill in a table 
-	/// containing the name, weight, and value of each score term.
+	/// containing the value of each score term.
 	virtual double evaluate(DeviceConstPtr, EvaluatedScoreFunction &) const;
 
-	/// @brief Add a term to this score function.
+	/// @brief Calculate a score for the given device, unless it becomes clear 
+	/// that the score will be less than the given threshold.  In that case, 
+	/// stop evaluating score terms, set the given flag, and return an upper 
+	/// bound on the score (which will be less than the threshold).  Terms that 
+	/// weren't evaluated are NaN in the score table, but terms can also be NaN 
+	/// by themselves, so only the flag says whether the device was rejected.  
+	/// The partition functions that were never calculated are counted by 
+	/// ViennaRnaFold::counters().
+	double evaluate_or_reject(
+			DeviceConstPtr, EvaluatedScoreFunction &, double, bool &) const;
+
+	/// @brief Calculate scores for several devices at once.  The scores are 
+	/// returned in the same order as the devices.
+	vector<double> evaluate_many(vector<DeviceConstPtr> const &) const;
+
+	/// @brief Calculate scores for several devices at once, and fill in a score 
+	/// table for each.  Every combination of device and context is folded in 
+	/// parallel, so this is more efficient than scoring each device separately.
+	vector<double> evaluate_many(
+			vector<DeviceConstPtr> const &,
+			vector<EvaluatedScoreFunction> &) const;
+
+	/// @brief Return the layout of the score tables filled in by this 
+	/// function.
+	ScoreSchemaConstPtr schema() const;
+
+	/// @brief Return a cheaper score function that approximates this one, for 
+	/// prescreening moves (see MonteCarlo::surrogate_scorefxn()).  It has the 
+	/// same aptamer and contexts, and the surrogate of each term that has one 
+	/// (see ScoreTerm::surrogate()), with the same weight.
+	ScoreFunctionPtr surrogate() const;
+
+	/// @brief Work out which partition functions would be needed to score the 
+	/// given devices in every context.  The plan hasn't been run yet.  This is 
+	/// what evaluate() and evaluate_many() use internally.  Terms that don't 
+	/// declare the partition functions they need (see 
+	/// ScoreTerm::fold_requests()) aren't included.
+	FoldPlan plan(vector<DeviceConstPtr> const &) const;
+
+	/// @brief Add a term to this score function.  Terms shouldn't be renamed or 
+	/// reweighted after being added, because the schema won't be updated.
 	void add_term(ScoreTermPtr);
 
 	/// @brief Add a term to this score function.
@@ -126,19 +611,166 @@ public:
 	/// @brief Add a context to this score function with the given name.
 	void add_context(string, ContextConstPtr);
 
+	/// @brief Return the cache used to avoid rescoring sequences that have 
+	/// already been seen, or nullptr if no cache is being used.
+	ScoreCachePtr cache() const;
+
+	/// @brief Set the cache used to avoid rescoring sequences that have 
+	/// already been seen.  The same cache can be shared between score functions 
+	/// (and threads), because the cache keys include everything that affects 
+	/// the score.
+	void cache(ScoreCachePtr);
+
+	/// @brief Return the number of score terms that have been evaluated, the 
+	/// number that were skipped by evaluate_or_reject(), the number of 
+	/// partition functions that were requested and actually planned, how long 
+	/// the planned partition functions took, and the most DP memory that was 
+	/// held at once while evaluating a device (or a batch of devices).
+	ScoreFunctionCounters counters() const;
+
+	/// @brief Return the number of threads that will be used to evaluate 
+	/// contexts (and devices, for batches) in parallel.
+	int num_threads() const;
+
+	/// @brief Set the number of threads that will be used to evaluate contexts 
+	/// (and devices, for batches) in parallel.  Partition functions are also 
+	/// calculated in parallel, so even a single device with no contexts can use 
+	/// more than one thread.  The scores don't depend on the number of threads.
+	void num_threads(int);
+
 protected:
 
-	/// @brief Evaluate the score terms associated with this function.  This 
-	/// helps the public evaluate() method support contexts.
+	/// @brief Evaluate the score terms associated with this function for a 
+	/// device that's already in the right context.  The values are written to 
+	/// the given table starting at the given row, and the weighted sum of the 
+	/// values is returned.  Partition functions are taken from the given plan 
+	/// (which must already have been run) wherever possible, and the DP memory 
+	/// needed for anything else is recorded by the given tracker.  This helps 
+	/// the public evaluate() method support contexts.
 	double evaluate_terms(
 			DeviceConstPtr,
 			EvaluatedScoreFunction &,
-			string="") const;
+			int,
+			FoldPlan const &,
+			vector<pair<ConditionEnum,int>> const &,
+			DpMemoryTracker *) const;
+
+	/// @brief Return a string that uniquely identifies the score that this 
+	/// function would give the given device.
+	string cache_key(DeviceConstPtr) const;
+
+private:
+
+	/// @brief Calculate scores for several devices at once, filling in one 
+	/// score table for each device in the given array.
+	vector<double> evaluate_batch(
+			vector<DeviceConstPtr> const &,
+			EvaluatedScoreFunction *) const;
+
+	/// @brief Put each device into each context, in the order used by the score 
+	/// table (i.e. all the contexts for the first device, then all the contexts 
+	/// for the second, etc).
+	vector<DeviceConstPtr> contextualize(vector<DeviceConstPtr> const &) const;
+
+	/// @brief Add the partition functions needed by every term to the given 
+	/// plan.  For each of the given (contextualized) devices, note which jobs 
+	/// will be needed in which condition.
+	void plan_folds(
+			vector<DeviceConstPtr> const &,
+			FoldPlan &,
+			vector<vector<pair<ConditionEnum,int>>> &) const;
+
+	/// @brief Add the time taken by each job in the given plan (which must have 
+	/// been run) to the fold timings.
+	void record_fold_timings(FoldPlan const &) const;
+
+	/// @brief Rebuild the schema after a term or context has been added.
+	void compile_schema();
 
 private:
 	ScoreTermList my_terms;
 	AptamerConstPtr my_aptamer;
 	map<string,ContextConstPtr> my_contexts;
+	ScoreSchemaConstPtr my_schema;
+	vector<ContextConstPtr> my_schema_contexts;
+	vector<int> my_contexts_by_length;
+	long my_fold_jobs_per_device;
+	ScoreCachePtr my_cache;
+	int my_num_threads;
+	vector<FoldRequestList> my_term_fold_requests;
+	mutable std::atomic<long> my_terms_evaluated;
+	mutable std::atomic<long> my_terms_skipped;
+	mutable std::atomic<long> my_fold_requests;
+	mutable std::atomic<long> my_fold_jobs;
+	mutable map<FoldTimingsKey, FoldTimings> my_fold_timings;
+	mutable std::mutex my_fold_timings_mutex;
+	mutable std::atomic<long> my_peak_bytes_per_evaluation;
+
+};
+
+/// @brief Counters describing how well a score cache is working.
+struct ScoreCacheCounters {
+	long hits = 0;
+	long misses = 0;
+	long evictions = 0;
+};
+
+/// @brief A bounded, thread-safe map from devices to the scores they were 
+/// given.
+class ScoreCache {
+
+public:
+
+	/// @brief Specify how many scores to remember, and which score to forget 
+	/// once the cache is full.
+	ScoreCache(unsigned, EvictionEnum=EvictionEnum::LRU);
+
+	/// @brief If the given key is in the cache, fill in the score and score 
+	/// table associated with it and return true.  Otherwise return false.
+	bool lookup(string const &, double &, EvaluatedScoreFunction &);
+
+	/// @brief Remember the score and score table associated with the given key, 
+	/// evicting an older entry if the cache is full.
+	void store(string const &, double, EvaluatedScoreFunction const &);
+
+	/// @brief Forget every score in the cache.  The counters are not reset.
+	void clear();
+
+	/// @brief Return the number of scores currently in the cache.
+	unsigned size() const;
+
+	/// @brief Return the maximum number of scores that will be remembered.
+	unsigned capacity() const;
+
+	/// @brief Return the policy used to decide which score to forget when the 
+	/// cache is full.
+	EvictionEnum eviction() const;
+
+	/// @brief Return the number of hits, misses, and evictions so far.
+	ScoreCacheCounters counters() const;
+
+private:
+
+	struct Entry {
+		string key;
+		double score;
+		EvaluatedScoreFunction table;
+	};
+
+	// The sequenced index keeps track of which entry should be evicted next 
+	// (the back), and the hashed index makes lookups fast.
+	using EntryContainer = boost::multi_index_container<
+		Entry,
+		boost::multi_index::indexed_by<
+			boost::multi_index::sequenced<>,
+			boost::multi_index::hashed_unique<
+				boost::multi_index::member<Entry, string, &Entry::key> > > >;
+
+	unsigned my_capacity;
+	EvictionEnum my_eviction;
+	EntryContainer my_entries;
+	ScoreCacheCounters my_counters;
+	mutable std::mutex my_mutex;
 
 };
 
@@ -153,6 +785,23 @@ public:
 	virtual double evaluate(
 			DeviceConstPtr, RnaFold const &, RnaFold const &) const = 0;
 
+	/// @brief Return the largest value this term could possibly have.  This is 
+	/// used to stop evaluating score functions that can't possibly reach a 
+	/// given score.  By default, terms are assumed to be unbounded.
+	virtual double max_value() const;
+
+	/// @brief Return the partition functions this term will ask for, so that 
+	/// they can be calculated ahead of time (and in parallel).  Terms don't have 
+	/// to declare anything, but anything they don't declare will be calculated 
+	/// when it's asked for.  By default, nothing is declared.
+	virtual FoldRequestList fold_requests() const;
+
+	/// @brief Return a cheaper term that approximates this one, or nullptr if 
+	/// there isn't one.  Surrogates don't need to be accurate, just correlated 
+	/// with the real term, because they're only used to decide which moves are 
+	/// worth scoring exactly.  By default, there is no surrogate.
+	virtual ScoreTermPtr surrogate() const;
+
 	/// @brief Return this score term's name.
 	string name() const;
 
@@ -184,6 +833,77 @@ public:
 	/// given fold in the given condition.
 	double evaluate(DeviceConstPtr, RnaFold const &, RnaFold const &) const;
 
+	/// @brief Return 0, because probabilities can't be greater than 1.
+	double max_value() const;
+
+	/// @brief Ask for the partition function of the macrostate in the condition 
+	/// this term cares about.
+	FoldRequestList fold_requests() const;
+
+	/// @brief Return a MfeMacrostateProbTerm for the same macrostate, condition, 
+	/// and preference.
+	ScoreTermPtr surrogate() const;
+
+private:
+		string my_macrostate;
+		ConditionEnum my_condition;
+		FavorableEnum my_favorable;
+
+};
+
+/// @brief Like MacrostateProbTerm, but the probability is estimated from 
+/// minimum free energies (see RnaFold::macrostate_mfe_prob()).  This is much 
+/// cheaper, but only approximate, so it's meant to be used as a surrogate.
+class MfeMacrostateProbTerm : public ScoreTerm {
+
+public:
+
+	/// @brief Initialize the score term with a fold, a condition, and an 
+	/// indication of whether or not we want that fold in that condition.
+	MfeMacrostateProbTerm(string, ConditionEnum, FavorableEnum=FavorableEnum::YES);
+
+	/// @brief Calculate the log of the estimated probability that the given 
+	/// device adopts the given fold in the given condition.
+	double evaluate(DeviceConstPtr, RnaFold const &, RnaFold const &) const;
+
+	/// @brief Return 0, because probabilities can't be greater than 1.
+	double max_value() const;
+
+private:
+		string my_macrostate;
+		ConditionEnum my_condition;
+		FavorableEnum my_favorable;
+
+};
+
+/// @brief Score how well the ensemble satisfies a macrostate, using the 
+/// base-pair probabilities from a single unconstrained partition function.
+///
+/// @details Every position constrained by the macrostate (i.e. paired by '(' 
+/// and ')' or unpaired by 'x') is satisfied with the probability that it 
+/// adopts the constrained state.  The ensemble defect is the expected 
+/// fraction of those positions that aren't satisfied, and the term's value 
+/// is its negative, so it ranges from -1 to 0.  Positions marked with '.' 
+/// aren't counted.  The base-pair probabilities are cached by the folding 
+/// engine, so any number of these terms cost one partition function per 
+/// condition, instead of one each like MacrostateProbTerm.
+class EnsembleDefectTerm : public ScoreTerm {
+
+public:
+
+	/// @brief Initialize the score term with a fold, a condition, and an 
+	/// indication of whether or not we want that fold in that condition.  If 
+	/// not, the term penalizes the expected fraction of constrained positions 
+	/// that are satisfied, instead of those that aren't.
+	EnsembleDefectTerm(string, ConditionEnum, FavorableEnum=FavorableEnum::YES);
+
+	/// @brief Calculate the negative ensemble defect of the given device with 
+	/// respect to the given fold in the given condition.
+	double evaluate(DeviceConstPtr, RnaFold const &, RnaFold const &) const;
+
+	/// @brief Return 0, because the defect can't be negative.
+	double max_value() const;
+
 private:
 		string my_macrostate;
 		ConditionEnum my_condition;
@@ -202,4 +922,7 @@ operator<<(ostream&, const addapt::ConditionEnum&);
 ostream&
 operator<<(ostream&, const addapt::FavorableEnum&);
 
+ostream&
+operator<<(ostream&, const addapt::EvictionEnum&);
+
 }
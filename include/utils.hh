@@ -1,6 +1,8 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
+#include <exception>
 #include <iostream>
 #include <iterator>
 #include <list>
@@ -32,10 +34,16 @@ enum class IndexEnum {
 };
 
 int
-normalize_index(string, int, IndexEnum);
+normalize_index(string const &, int, IndexEnum);
+
+int
+normalize_index(int, int, IndexEnum);
+
+pair<int,int>
+normalize_range(string const &, int, int, IndexEnum);
 
 pair<int,int>
-normalize_range(string, int, int, IndexEnum);
+normalize_range(int, int, int, IndexEnum);
 
 enum class ColorEnum {
 	NORMAL = 0,
@@ -63,6 +71,38 @@ contains(Container c, Value val) {
 	return std::find(c.begin(), c.end(), val) != c.end();
 }
 
+/// @brief Raise the given atomic to the given value, if it's currently lower.
+template <class T> void
+atomic_max(std::atomic<T> &max, T value) {
+	T current = max;
+	while(current < value and not max.compare_exchange_weak(current, value));
+}
+
+/// @brief Call the given function once for each index from 0 to n-1, using 
+/// the given number of threads.
+///
+/// @details Exceptions can't propagate out of an OpenMP region, so the last 
+/// exception to be thrown (if any) is rethrown after every thread finishes.
+template <class Function> void
+parallel_for(int n, int num_threads, Function function) {
+	std::exception_ptr error;
+
+	#pragma omp parallel for num_threads(num_threads) schedule(dynamic)
+	for(int i = 0; i < n; i++) {
+		try {
+			function(i);
+		}
+		catch(...) {
+			#pragma omp critical
+			error = std::current_exception();
+		}
+	}
+
+	if(error) {
+		std::rethrow_exception(error);
+	}
+}
+
 
 }
 
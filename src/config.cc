@@ -1,5 +1,7 @@
 #include <regex>
+#include <stdexcept>
 
+#include <boost/algorithm/string.hpp>
 #include <yaml-cpp/yaml.h>
 
 #include "config.hh"
@@ -66,6 +68,10 @@ device_from_yaml(vector<string> config_files) {
 				item.second.as<string>());
 	}
 
+	// Compile the macrostates right away, so that any base pairs that can't 
+	// be satisfied are reported before the simulation starts.
+	device->position_graph();
+
 	return device;
 }
 
@@ -102,22 +108,34 @@ scorefxn_from_yaml(vector<string> config_files) {
 
 ScoreTermPtr
 score_term_from_str(ConditionEnum condition, string spec) {
-	std::regex pattern("(not )?(\\w+)");
+	// Objectives look like "active", "not active", "defect active", or "defect 
+	// not active".  The "defect" prefix scores the macrostate by its ensemble 
+	// defect instead of its probability.
+	std::regex pattern("(defect )?(not )?(\\w+)");
 	std::smatch match;
 
 	if(std::regex_match(spec, match, pattern)) {
-		return make_shared<MacrostateProbTerm>(
-				match[2], condition, match[1].matched?
-				FavorableEnum::NO : FavorableEnum::YES);
+		FavorableEnum favorable = match[2].matched?
+				FavorableEnum::NO : FavorableEnum::YES;
+
+		if(match[1].matched) {
+			return make_shared<EnsembleDefectTerm>(match[3], condition, favorable);
+		}
+		return make_shared<MacrostateProbTerm>(match[3], condition, favorable);
 	}
 
 	throw (f("can't understand objective: '%s'") % spec).str();
 }
 
+string
+thermostat_spec_from_yaml(vector<string> config_files) {
+	YAML::Node section = find_section(config_files, "thermostat", OPTIONAL);
+	return section? section.as<string>() : "1";
+}
+
 ThermostatPtr
 thermostat_from_yaml(vector<string> config_files) {
-	YAML::Node section = find_section(config_files, "thermostat", OPTIONAL);
-	return thermostat_from_str(section? section.as<string>() : "1");
+	return thermostat_from_str(thermostat_spec_from_yaml(config_files));
 }
 
 ThermostatPtr
@@ -174,5 +192,49 @@ thermostat_from_str(string spec) {
 	throw (f("can't make a thermostat from '%s'") % spec).str();
 }
 
+vector<double>
+temperatures_from_str(string spec) {
+	vector<string> fields;
+	vector<double> temperatures;
+
+	boost::split(fields, spec, boost::is_any_of(","));
+
+	for(string field: fields) {
+		boost::trim(field);
+		try {
+			temperatures.push_back(stod(field));
+		}
+		catch(std::logic_error const &) {
+			throw (f("can't understand temperature '%s' in '%s'") % field % spec).str();
+		}
+	}
+
+	for(int i = 1; i < int(temperatures.size()); i++) {
+		if(temperatures[i] < temperatures[i-1]) {
+			throw (f("temperatures must be in increasing order: '%s'") % spec).str();
+		}
+	}
+
+	return temperatures;
+}
+
+ScoreCachePtr
+cache_from_str(string capacity_spec, string eviction_spec) {
+	int capacity = stoi(capacity_spec);
+	if(capacity < 0) {
+		throw (f("can't make a cache with %d entries") % capacity).str();
+	}
+	if(capacity == 0) {
+		return nullptr;
+	}
+
+	EvictionEnum eviction;
+	if(eviction_spec == "lru") eviction = EvictionEnum::LRU;
+	else if(eviction_spec == "fifo") eviction = EvictionEnum::FIFO;
+	else throw (f("unknown cache eviction policy '%s'") % eviction_spec).str();
+
+	return make_shared<ScoreCache>(capacity, eviction);
+}
+
 
 }
@@ -1,53 +1,110 @@
 #include <algorithm>
+#include <cctype>
+
+#include <boost/functional/hash.hpp>
 
 #include "model.hh"
 #include "utils.hh"
 
 namespace addapt {
 
+// Sequences are packed two bits per nucleotide into 64-bit words, and the 
+// mutability of each position is packed one bit per position.
+static int const NUCS_PER_WORD = 32;
+static int const FLAGS_PER_WORD = 64;
+static char const UPPER_NUCS[] = "ACGU";
+static char const LOWER_NUCS[] = "acgu";
+
+static int
+encode_nuc(char nuc) {
+	switch(nuc) {
+		case 'A': case 'a': return 0;
+		case 'C': case 'c': return 1;
+		case 'G': case 'g': return 2;
+		case 'U': case 'u': return 3;
+		default: return -1;
+	}
+}
+
+static ContextConstPtr
+empty_context() {
+	static ContextConstPtr const context = make_shared<Context>();
+	return context;
+}
+
+static MacrostateTableConstPtr
+empty_macrostate_table() {
+	static MacrostateTableConstPtr const table = make_shared<MacrostateTable>();
+	return table;
+}
+
 Device::Device(string seq):
-	my_seq(seq), my_context(make_shared<Context>()) {}
+	my_len(seq.length()),
+	my_bases((seq.length() + NUCS_PER_WORD - 1) / NUCS_PER_WORD, 0),
+	my_mutable((seq.length() + FLAGS_PER_WORD - 1) / FLAGS_PER_WORD, 0),
+	my_macrostates(empty_macrostate_table()),
+	my_context(empty_context()) {
+
+	for(int i = 0; i < my_len; i++) {
+		set(i, seq[i]);
+	}
+}
 
 int
 Device::len() const {
-	return seq().length();
+	return my_context->before().length() + my_len + my_context->after().length();
 }
 
 string
 Device::seq() const {
-	return my_context->before() + my_seq + my_context->after();
+	return my_context->before() + raw_seq() + my_context->after();
 }
 
 char
 Device::seq(int index) const {
-	index = normalize_index(seq(), index, IndexEnum::ITEM);
-	return seq()[index];
+	index = normalize_index(len(), index, IndexEnum::ITEM);
+
+	string const &before = my_context->before();
+	int const before_len = before.length();
+	if(index < before_len) {
+		return before[index];
+	}
+	index -= before_len;
+	if(index < my_len) {
+		return get(index);
+	}
+	return my_context->after()[index - my_len];
 }
 
 int
 Device::raw_len() const {
-	return my_seq.length();
+	return my_len;
 }
 
 string
 Device::raw_seq() const {
-	return my_seq;
+	string seq(my_len, ' ');
+	for(int i = 0; i < my_len; i++) {
+		seq[i] = get(i);
+	}
+	return seq;
 }
 
 char
 Device::raw_seq(int index) const {
-	index = normalize_index(my_seq, index, IndexEnum::ITEM);
-	return my_seq[index];
+	index = normalize_index(my_len, index, IndexEnum::ITEM);
+	return get(index);
 }
 
 string
 Device::macrostate(string name) const {
-	if(my_macrostates.find(name) == my_macrostates.end()) {
+	string const *macrostate = my_macrostates->find(name);
+	if(not macrostate) {
 		throw (f("no macrostate '%s'") % name).str();
 	}
 	string before(my_context->before().length(), '.');
 	string after(my_context->after().length(), '.');
-	return before + my_macrostates.at(name) + after;
+	return before + *macrostate + after;
 }
 
 Device::macrostate_view
@@ -55,12 +112,50 @@ Device::macrostates() const {
 	return macrostate_view(*this);
 }
 
+Device::macrostate_iterator
+Device::macrostate_view::begin() {
+	return macrostate_iterator(my_device, my_device.my_macrostates->begin());
+}
+
+Device::macrostate_iterator
+Device::macrostate_view::end() {
+	return macrostate_iterator(my_device, my_device.my_macrostates->end());
+}
+
 void
 Device::add_macrostate(string name, string macrostate) {
-	if(macrostate.length() != my_seq.length()) {
+	if(int(macrostate.length()) != my_len) {
 		throw "constraint length doesn't match sequence length";
 	}
-	my_macrostates[name] = macrostate;
+	my_macrostates = make_shared<MacrostateTable>(
+			*my_macrostates, name, macrostate);
+	my_position_graph.reset();
+}
+
+MacrostateTableConstPtr
+Device::macrostate_table() const {
+	return my_macrostates;
+}
+
+HardConstraintConstPtr
+Device::macrostate_constraint(string const &name) const {
+	HardConstraintConstPtr constraint = my_macrostates->constraint(
+			name,
+			my_context->before().length(),
+			my_context->after().length());
+
+	if(not constraint) {
+		throw (f("no macrostate '%s'") % name).str();
+	}
+	return constraint;
+}
+
+PositionGraphConstPtr
+Device::position_graph() const {
+	if(not my_position_graph) {
+		my_position_graph = make_shared<PositionGraph>(*this);
+	}
+	return my_position_graph;
 }
 
 ContextConstPtr
@@ -75,28 +170,386 @@ Device::context(ContextConstPtr context) {
 
 void
 Device::remove_context() {
-	my_context = make_shared<Context>();
+	context(empty_context());
 }
 
 void
 Device::mutate(int context_indep_index, char const mutation) {
-	int index = normalize_index(my_seq, context_indep_index, IndexEnum::ITEM);
-	my_seq[index] = mutation;
+	int index = normalize_index(my_len, context_indep_index, IndexEnum::ITEM);
+	char const before = get(index);
+	if(before != mutation) {
+		my_mutations.push_back({index, before, mutation});
+		set(index, mutation);
+	}
+}
+
+MutationLog const &
+Device::mutations() const {
+	return my_mutations;
+}
+
+void
+Device::undo_mutations() {
+	for(auto it = my_mutations.rbegin(); it != my_mutations.rend(); ++it) {
+		set(it->index, it->before);
+	}
+	my_mutations.clear();
+}
+
+void
+Device::forget_mutations() {
+	my_mutations.clear();
+}
+
+void
+Device::replay_mutations(MutationLog const &mutations) {
+	for(auto const &mutation: mutations) {
+		set(mutation.index, mutation.after);
+	}
 }
 
 DevicePtr
 Device::copy() const {
-	DevicePtr other = std::make_shared<Device>(my_seq);
-	other->my_macrostates = my_macrostates;
-	other->my_context = my_context;
+	DevicePtr other = std::make_shared<Device>(*this);
+	other->my_mutations.clear();
 	return other;
 }
 
 void
 Device::assign(DevicePtr other) {
-	my_seq = other->my_seq;
-	my_macrostates = other->my_macrostates;
-	my_context = other->my_context;
+	*this = *other;
+	my_mutations.clear();
+}
+
+size_t
+Device::hash() const {
+	size_t seed = my_len;
+	for(uint64_t word: my_bases) boost::hash_combine(seed, word);
+	for(uint64_t word: my_mutable) boost::hash_combine(seed, word);
+	for(auto const &exception: my_exceptions) {
+		boost::hash_combine(seed, exception.first);
+		boost::hash_combine(seed, exception.second);
+	}
+	boost::hash_combine(seed, my_macrostates->hash());
+	boost::hash_combine(seed, my_context->before());
+	boost::hash_combine(seed, my_context->after());
+	return seed;
+}
+
+bool
+Device::operator==(Device const &other) const {
+	return my_len == other.my_len and
+		my_bases == other.my_bases and
+		my_mutable == other.my_mutable and
+		my_exceptions == other.my_exceptions and
+		(my_macrostates == other.my_macrostates or
+		 *my_macrostates == *other.my_macrostates) and
+		(my_context == other.my_context or
+		 (my_context->before() == other.my_context->before() and
+		  my_context->after() == other.my_context->after()));
+}
+
+bool
+Device::operator!=(Device const &other) const {
+	return not (*this == other);
+}
+
+char
+Device::get(int index) const {
+	// Most devices have no exceptions, so don't bother searching unless there 
+	// are some.
+	if(not my_exceptions.empty()) {
+		auto it = std::lower_bound(
+				my_exceptions.begin(), my_exceptions.end(),
+				std::make_pair(index, '\0'));
+		if(it != my_exceptions.end() and it->first == index) {
+			return it->second;
+		}
+	}
+
+	int const code = (my_bases[index / NUCS_PER_WORD] >>
+			(2 * (index % NUCS_PER_WORD))) & 3;
+	bool const is_mutable = (my_mutable[index / FLAGS_PER_WORD] >>
+			(index % FLAGS_PER_WORD)) & 1;
+
+	return is_mutable? UPPER_NUCS[code] : LOWER_NUCS[code];
+}
+
+void
+Device::set(int index, char nuc) {
+	int const code = encode_nuc(nuc);
+
+	// Store the base.  Exceptions are stored as 0, so that equivalent devices 
+	// always have the same bits.
+	uint64_t &bases = my_bases[index / NUCS_PER_WORD];
+	int const shift = 2 * (index % NUCS_PER_WORD);
+	bases &= ~(uint64_t(3) << shift);
+	bases |= uint64_t(std::max(code, 0)) << shift;
+
+	// Store whether or not the position is mutable.
+	uint64_t &flags = my_mutable[index / FLAGS_PER_WORD];
+	uint64_t const flag = uint64_t(1) << (index % FLAGS_PER_WORD);
+	if(isupper(nuc)) flags |= flag; else flags &= ~flag;
+
+	// Store anything that isn't ACGU in the list of exceptions.
+	auto it = std::lower_bound(
+			my_exceptions.begin(), my_exceptions.end(),
+			std::make_pair(index, '\0'));
+	bool const listed = (it != my_exceptions.end() and it->first == index);
+
+	if(code < 0) {
+		if(listed) it->second = nuc;
+		else my_exceptions.insert(it, {index, nuc});
+	}
+	else if(listed) {
+		my_exceptions.erase(it);
+	}
+}
+
+
+MacrostateTable::MacrostateTable(): my_hash(0) {}
+
+MacrostateTable::MacrostateTable(
+		MacrostateTable const &other, string name, string macrostate):
+
+	my_macrostates(other.my_macrostates), my_hash(0) {
+
+	auto it = std::lower_bound(
+			my_macrostates.begin(), my_macrostates.end(),
+			value_type(name, ""),
+			[](value_type const &a, value_type const &b) {
+				return a.first < b.first;
+			});
+
+	if(it != my_macrostates.end() and it->first == name) {
+		it->second = macrostate;
+	}
+	else {
+		my_macrostates.insert(it, value_type(name, macrostate));
+	}
+
+	for(auto const &item: my_macrostates) {
+		boost::hash_combine(my_hash, item.first);
+		boost::hash_combine(my_hash, item.second);
+	}
+}
+
+string const *
+MacrostateTable::find(string const &name) const {
+	for(auto const &item: my_macrostates) {
+		if(item.first == name) return &item.second;
+	}
+	return nullptr;
+}
+
+int
+MacrostateTable::size() const {
+	return my_macrostates.size();
+}
+
+MacrostateTable::const_iterator
+MacrostateTable::begin() const {
+	return my_macrostates.begin();
+}
+
+MacrostateTable::const_iterator
+MacrostateTable::end() const {
+	return my_macrostates.end();
+}
+
+size_t
+MacrostateTable::hash() const {
+	return my_hash;
+}
+
+bool
+MacrostateTable::operator==(MacrostateTable const &other) const {
+	return my_hash == other.my_hash and my_macrostates == other.my_macrostates;
+}
+
+HardConstraintConstPtr
+MacrostateTable::constraint(string const &name, int before, int after) const {
+	int const num_macrostates = my_macrostates.size();
+	int index = 0;
+	while(index < num_macrostates and my_macrostates[index].first != name) {
+		index++;
+	}
+	if(index == num_macrostates) {
+		return nullptr;
+	}
+
+	std::lock_guard<std::mutex> lock(my_constraints_mutex);
+	HardConstraintConstPtr &constraint = my_constraints[
+		std::make_tuple(index, before, after)];
+
+	if(not constraint) {
+		constraint = make_shared<HardConstraint>(
+				string(before, '.') + my_macrostates[index].second + string(after, '.'));
+	}
+	return constraint;
+}
+
+
+HardConstraint::HardConstraint(string const &dot_bracket):
+	my_dot_bracket(dot_bracket), my_compiled(true) {
+
+	vector<int> open_positions;
+
+	for(int i = 1; i <= int(dot_bracket.length()); i++) {
+		switch(dot_bracket[i - 1]) {
+			case '.':
+				break;
+
+			case 'x':
+				my_operations.push_back({i, 0});
+				break;
+
+			case '(':
+				open_positions.push_back(i);
+				break;
+
+			case ')':
+				if(open_positions.empty()) {
+					throw (f("mismatched base-pair in constraint: '%s'") % dot_bracket).str();
+				}
+				my_operations.push_back({open_positions.back(), i});
+				open_positions.pop_back();
+				break;
+
+			default:
+				my_compiled = false;
+				break;
+		}
+	}
+
+	if(not open_positions.empty()) {
+		throw (f("mismatched base-pair in constraint: '%s'") % dot_bracket).str();
+	}
+
+	// Don't keep a partial list of operations for constraints that have to be 
+	// applied from the dot-bracket string anyway.
+	if(not my_compiled) {
+		my_operations.clear();
+	}
+}
+
+string const &
+HardConstraint::dot_bracket() const {
+	return my_dot_bracket;
+}
+
+bool
+HardConstraint::is_compiled() const {
+	return my_compiled;
+}
+
+vector<HardConstraint::Operation> const &
+HardConstraint::operations() const {
+	return my_operations;
+}
+
+
+PositionGraph::PositionGraph(Device const &device) {
+	string const seq = device.raw_seq();
+	int const len = seq.length();
+
+	// Find every base pair in every macrostate.  Also keep track of which 
+	// positions are the 3' end of any base pair.
+	vector<vector<int>> partners(len);
+	vector<bool> is_3_prime(len, false);
+
+	for(auto const &item: *device.macrostate_table()) {
+		string const &macrostate = item.second;
+		vector<int> open_positions;
+
+		for(int i = 0; i < len; i++) {
+			if(macrostate[i] == '(') {
+				open_positions.push_back(i);
+			}
+			else if(macrostate[i] == ')') {
+				if(open_positions.empty()) {
+					throw (f("mismatched base-pair in '%s' macrostate: '%s'") % item.first % macrostate).str();
+				}
+				int partner = open_positions.back();
+				open_positions.pop_back();
+
+				partners[i].push_back(partner);
+				partners[partner].push_back(i);
+				is_3_prime[i] = true;
+			}
+		}
+
+		if(not open_positions.empty()) {
+			throw (f("mismatched base-pair in '%s' macrostate: '%s'") % item.first % macrostate).str();
+		}
+	}
+
+	// Group the mutable positions into components of linked positions, and 
+	// color each component with a breadth-first search.  Finding a partner 
+	// with the same color means there's an odd cycle of base pairs, which no 
+	// sequence can satisfy.
+	my_component_ids.assign(len, -1);
+	my_colors.assign(len, false);
+
+	for(int i = 0; i < len; i++) {
+		if(not isupper(seq[i]) or my_component_ids[i] >= 0) {
+			continue;
+		}
+
+		int const id = my_components.size();
+		my_components.emplace_back(1, i);
+		my_component_ids[i] = id;
+		vector<int> &component = my_components.back();
+
+		for(int j = 0; j < int(component.size()); j++) {
+			int const position = component[j];
+
+			for(int partner: partners[position]) {
+				if(not isupper(seq[partner])) {
+					throw (f("position '%d' can be mutated, but it's base-paired to position '%d' which can't be.") % position % partner).str();
+				}
+				if(my_component_ids[partner] < 0) {
+					my_component_ids[partner] = id;
+					my_colors[partner] = not my_colors[position];
+					component.push_back(partner);
+				}
+				else if(my_colors[partner] == my_colors[position]) {
+					throw (f("no way to satisfy all base pairing constraints: positions '%d' and '%d' are paired, but must also be the same.") % position % partner).str();
+				}
+			}
+		}
+
+		std::sort(component.begin(), component.end());
+	}
+
+	for(int i = 0; i < len; i++) {
+		if(is_mutable(i) and not is_3_prime[i]) {
+			my_free_positions.push_back(i);
+		}
+	}
+}
+
+bool
+PositionGraph::is_mutable(int position) const {
+	return my_component_ids.at(position) >= 0;
+}
+
+vector<int> const &
+PositionGraph::free_positions() const {
+	return my_free_positions;
+}
+
+vector<int> const &
+PositionGraph::component(int position) const {
+	if(not is_mutable(position)) {
+		throw (f("position '%d' can't be mutated") % position).str();
+	}
+	return my_components[my_component_ids[position]];
+}
+
+bool
+PositionGraph::complementary(int position, int partner) const {
+	return my_colors.at(position) != my_colors.at(partner);
 }
 
 
@@ -122,12 +575,12 @@ Aptamer::affinity() const {
 Context::Context(string before, string after):
 	my_before(before), my_after(after) {}
 
-string
+string const &
 Context::before() const {
 	return my_before;
 }
 
-string
+string const &
 Context::after() const {
 	return my_after;
 }
@@ -1,9 +1,14 @@
 #include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <cctype>
 #include <cmath>
 #include <iostream>
+#include <limits>
 #include <regex>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
 
 #include "sampling.hh"
 #include "utils.hh"
@@ -14,10 +19,17 @@ namespace addapt {
 
 MonteCarlo::MonteCarlo(): 
 	my_steps(0),
+	my_early_rejection(false),
+	my_speculation(1),
 	my_thermostat(std::make_shared<FixedThermostat>(1)),
 	my_scorefxn(std::make_shared<ScoreFunction>()),
 	my_moves(),
-	my_reporters() {}
+	my_reporters(),
+	my_prescreened(0),
+	my_prescreen_rejections(0),
+	my_prescreen_pf_calls_saved(0),
+	my_speculative_proposals(0),
+	my_speculative_proposals_discarded(0) {}
 
 DevicePtr
 MonteCarlo::apply(DevicePtr device, std::mt19937 &rng) const {
@@ -25,80 +37,1001 @@ MonteCarlo::apply(DevicePtr device, std::mt19937 &rng) const {
 		return device;
 	}
 
+	MonteCarloStep step;
+	start(step, device, rng);
+
+	while(step.i < step.num_steps) {
+		iterate(step, rng);
+	}
+
+	finish(step);
+	return step.current_device;
+}
+
+void
+MonteCarlo::start(
+		MonteCarloStep &step, DevicePtr device, std::mt19937 &rng) const {
+
 	// Setup to data structure that will hold all the information about each 
 	// step.  The purpose of this structure is to support external logging 
 	// methods and thermostats.
-	MonteCarloStep step;
 	step.num_steps = my_steps; step.i = -1;
-	step.current_device = device;
 
-	// Create random number distributions for later use.
-	auto random = std::bind(std::uniform_real_distribution<>(), rng);
-	auto randmove = std::bind(std::uniform_int_distribution<>(0, my_moves.size()-1), rng);
+	// Make the only two copies of the device that the simulation will need.  
+	// Moves are made in place on the proposed device, then either replayed on 
+	// the current device or undone, so the two stay in sync between steps.
+	step.current_device = device->copy();
+	step.proposed_device = device->copy();
+
+	// Make copies of the random number generator for choosing moves and 
+	// Metropolis thresholds.
+	step.move_rng = rng;
+	step.threshold_rng = rng;
+
+	// Get an initial score.
+	step.current_score = my_scorefxn->evaluate(step.current_device, step.score_table);
+	step.proposed_score = step.current_score;
+
+	step.current_surrogate_score = my_surrogate_scorefxn?
+		my_surrogate_scorefxn->evaluate(step.current_device, step.surrogate_table) : 0;
+	step.proposed_surrogate_score = step.current_surrogate_score;
+	step.prescreen_rejected = false;
+
+	if(my_speculation > 1 and my_surrogate_scorefxn) {
+		throw string("can't use delayed acceptance with speculative proposals");
+	}
+	step.speculative_devices.clear();
+	step.speculative_moves.clear();
+	step.next_speculation = 0;
+
+	// Initialize the counters that will keep track of how often moves are 
+	// accepted and rejected.
+	step.outcome_counters[OutcomeEnum::REJECT] = 0;
+	step.outcome_counters[OutcomeEnum::ACCEPT_WORSENED] = 0;
+	step.outcome_counters[OutcomeEnum::ACCEPT_UNCHANGED] = 0;
+	step.outcome_counters[OutcomeEnum::ACCEPT_IMPROVED] = 0;
+
+	// Initialize the reporters
+	for(auto reporter: my_reporters) {
+		reporter->start(step);
+	}
+
+	step.i = 0;
+}
+
+void
+MonteCarlo::iterate(MonteCarloStep &step, std::mt19937 &rng) const {
+	// Create random number distributions for later use.
+	auto random = [&]() {
+		return std::uniform_real_distribution<>()(step.threshold_rng);
+	};
+	auto randmove = [&]() {
+		return std::uniform_int_distribution<>(0, my_moves.size()-1)(step.move_rng);
+	};
+
+	// Get the temperature for the Metropolis criterion.  This has to be done 
+	// every iteration, even if no accept/reject decision needs to be made.
+
+	step.temperature = my_thermostat->adjust(step);
+
+	// Randomly pick a move to apply.  The move mutates the proposed device in 
+	// place, and the device keeps a log of the mutations so they can be undone.  
+	// Speculative proposals were made (and scored) ahead of time, so their 
+	// mutations just need to be copied onto the proposed device.  Heat-bath 
+	// moves are scored and chosen here, and the choice is copied the same way.
+	bool const speculative = my_speculation > 1;
+	bool heat_bath = false;
+
+	if(speculative) {
+		if(step.next_speculation == int(step.speculative_devices.size())) {
+			speculate(step, rng);
+		}
+		int const k = step.next_speculation++;
+		step.move = step.speculative_moves[k];
+		for(auto const &mutation: step.speculative_devices[k]->mutations()) {
+			step.proposed_device->mutate(mutation.index, mutation.after);
+		}
+	}
+	else {
+		step.move = my_moves[randmove()];
+		vector<DevicePtr> options =
+			step.move->heat_bath_options(step.current_device, rng);
+
+		if(options.empty()) {
+			step.move->apply(step.proposed_device, rng);
+		}
+		else {
+			choose_heat_bath_option(step, options);
+			heat_bath = true;
+		}
+	}
+
+	MutationLog const &mutations = step.proposed_device->mutations();
+	step.prescreen_rejected = false;
+
+	// Skip the score function evaluation if the sequence didn't change.
+	bool unchanged = std::all_of(
+			mutations.begin(), mutations.end(),
+			[&](Mutation const &mutation) {
+				return step.proposed_device->raw_seq(mutation.index) ==
+				       step.current_device->raw_seq(mutation.index);
+			});
+
+	if(unchanged) {
+		step.outcome = OutcomeEnum::ACCEPT_UNCHANGED;
+		step.proposed_score = step.current_score;
+		step.score_diff = 0;
+	}
+
+	// Heat-bath moves have already been scored, and are always accepted.
+	else if(heat_bath) {
+		step.score_diff = step.proposed_score - step.current_score;
+		step.outcome = (step.score_diff > 0)?
+			OutcomeEnum::ACCEPT_IMPROVED : OutcomeEnum::ACCEPT_WORSENED;
+
+		if(my_surrogate_scorefxn) {
+			step.proposed_surrogate_score = my_surrogate_scorefxn->evaluate(
+					step.proposed_device, step.surrogate_table);
+		}
+
+		step.current_device->replay_mutations(mutations);
+		step.current_score = step.proposed_score;
+		step.current_surrogate_score = step.proposed_surrogate_score;
+	}
+
+	// Score the proposed move, then either accept or reject it.
+	else {
+		bool hopeless = false;
+
+		// If delayed acceptance is enabled, give the move a cheap Metropolis test 
+		// using the surrogate score function first.  The exact test below is 
+		// then shifted by the change in the surrogate score, which is what makes 
+		// the two stages together satisfy detailed balance.
+		double surrogate_diff = 0;
+
+		if(my_surrogate_scorefxn) {
+			step.proposed_surrogate_score = my_surrogate_scorefxn->evaluate(
+					step.proposed_device, step.surrogate_table);
+			surrogate_diff = step.proposed_surrogate_score - step.current_surrogate_score;
+
+			step.random_threshold = random();
+			step.metropolis_criterion = std::exp(surrogate_diff / step.temperature);
+			step.prescreen_rejected = 
+				step.metropolis_criterion < step.random_threshold;
+
+			my_prescreened++;
+			if(step.prescreen_rejected) {
+				my_prescreen_rejections++;
+				my_prescreen_pf_calls_saved += 
+					my_scorefxn->plan({step.proposed_device}).jobs().size();
+			}
+		}
+
+		if(step.prescreen_rejected) {
+			step.proposed_score = std::numeric_limits<double>::quiet_NaN();
+			step.score_diff = std::numeric_limits<double>::quiet_NaN();
+		}
+		else if(speculative) {
+			int const k = step.next_speculation - 1;
+			step.proposed_score = step.speculative_scores[k];
+			std::swap(step.score_table, step.speculative_tables[k]);
+			step.random_threshold = random();
+		}
+		// If early rejection is enabled, draw the random threshold first and 
+		// work out the lowest score that could be accepted.  The score function 
+		// can then stop as soon as it's clear that the proposed device can't 
+		// reach that score.  The accept/reject decisions are the same either way, 
+		// but a rejected device only gets an upper bound on its score, so it's 
+		// left unscored (like a prescreen rejection) rather than reported.
+		else if(my_early_rejection) {
+			step.random_threshold = random();
+			double min_score = (step.temperature > 0)?
+				step.current_score + surrogate_diff + 
+					step.temperature * log(step.random_threshold) :
+				step.current_score + surrogate_diff;
+
+			step.proposed_score = my_scorefxn->evaluate_or_reject(
+					step.proposed_device, step.score_table, min_score, hopeless);
+		}
+		else {
+			step.proposed_score = my_scorefxn->evaluate(
+					step.proposed_device, step.score_table);
+			step.random_threshold = random();
+		}
+
+		if(hopeless) {
+			step.proposed_score = std::numeric_limits<double>::quiet_NaN();
+			step.score_diff = std::numeric_limits<double>::quiet_NaN();
+		}
+		else if(not step.prescreen_rejected) {
+			step.score_diff = step.proposed_score - step.current_score;
+			step.metropolis_criterion =
+				std::exp((step.score_diff - surrogate_diff) / step.temperature);
+		}
+
+		if(step.prescreen_rejected or hopeless or
+				step.metropolis_criterion < step.random_threshold) {
+			step.outcome = OutcomeEnum::REJECT;
+		}
+		else{
+			step.outcome = (step.score_diff > 0)?
+				OutcomeEnum::ACCEPT_IMPROVED : OutcomeEnum::ACCEPT_WORSENED;
+
+			step.current_device->replay_mutations(mutations);
+			step.current_score = step.proposed_score;
+			step.current_surrogate_score = step.proposed_surrogate_score;
+
+			// The remaining speculative proposals were made from the old device.
+			int const num_left = 
+				step.speculative_devices.size() - step.next_speculation;
+			my_speculative_proposals_discarded += num_left;
+			step.next_speculation = step.speculative_devices.size();
+		}
+	}
+
+	// Update the accept/reject statistics.
+	step.outcome_counters[step.outcome] += 1;
+
+	// Give the reporters a chance to react to the move.
+	for(auto reporter: my_reporters) {
+		reporter->update(step);
+	}
+
+	// Bring the proposed device back in sync with the current one.  This has 
+	// to wait until after the reporters, so they can see the rejected sequence.
+	if(step.outcome == OutcomeEnum::REJECT) {
+		step.proposed_device->undo_mutations();
+	}
+	else {
+		step.proposed_device->forget_mutations();
+	}
+
+	step.i++;
+}
+
+void
+MonteCarlo::choose_heat_bath_option(
+		MonteCarloStep &step, vector<DevicePtr> const &options) const {
+
+	int const num_options = options.size();
+
+	// Score every option that changes the sequence at once.  The others have 
+	// the same score as the current device.
+	vector<DeviceConstPtr> changed_devices;
+	vector<int> table_indices(num_options, -1);
+
+	for(int k = 0; k < num_options; k++) {
+		if(not options[k]->mutations().empty()) {
+			table_indices[k] = changed_devices.size();
+			changed_devices.push_back(options[k]);
+		}
+	}
+
+	vector<EvaluatedScoreFunction> tables;
+	vector<double> changed_scores = my_scorefxn->evaluate_many(changed_devices, tables);
+	vector<double> scores(num_options, step.current_score);
+
+	for(int k = 0; k < num_options; k++) {
+		if(table_indices[k] >= 0) scores[k] = changed_scores[table_indices[k]];
+	}
+
+	// Weight each option relative to the best one, so nothing overflows.  At 
+	// zero temperature, only the best options have any weight.
+	double const best_score = *std::max_element(scores.begin(), scores.end());
+	vector<double> weights(num_options);
+	double total_weight = 0;
+
+	for(int k = 0; k < num_options; k++) {
+		weights[k] = (step.temperature > 0)?
+			std::exp((scores[k] - best_score) / step.temperature) :
+			(scores[k] == best_score)? 1 : 0;
+		total_weight += weights[k];
+	}
+
+	// Pick an option in proportion to its weight.  The Metropolis criterion is 
+	// recorded as the probability of the option that was picked.
+	step.random_threshold =
+		std::uniform_real_distribution<>()(step.threshold_rng);
+
+	int choice = 0;
+	double cumulative_weight = weights[0];
+	while(choice < num_options - 1 and
+			cumulative_weight <= step.random_threshold * total_weight) {
+		cumulative_weight += weights[++choice];
+	}
+
+	step.metropolis_criterion = weights[choice] / total_weight;
+	step.proposed_score = scores[choice];
+
+	if(table_indices[choice] >= 0) {
+		std::swap(step.score_table, tables[table_indices[choice]]);
+	}
+	for(auto const &mutation: options[choice]->mutations()) {
+		step.proposed_device->mutate(mutation.index, mutation.after);
+	}
+}
+
+void
+MonteCarlo::speculate(MonteCarloStep &step, std::mt19937 &rng) const {
+	auto randmove = [&]() {
+		return std::uniform_int_distribution<>(0, my_moves.size()-1)(step.move_rng);
+	};
+
+	// Don't make proposals for steps that won't be taken.
+	int const num_proposals = std::min(my_speculation, step.num_steps - step.i);
+
+	step.speculative_devices.resize(num_proposals);
+	step.speculative_moves.resize(num_proposals);
+	step.speculative_scores.assign(num_proposals, 0);
+	step.speculative_tables.resize(num_proposals);
+	step.next_speculation = 0;
+
+	// Make every proposal from the current device, in the same order that the 
+	// moves and their random numbers would be drawn without speculation.
+	vector<DeviceConstPtr> changed_devices;
+	vector<int> changed_indices;
+
+	for(int k = 0; k < num_proposals; k++) {
+		step.speculative_moves[k] = my_moves[randmove()];
+		step.speculative_devices[k] = step.current_device->copy();
+		step.speculative_moves[k]->apply(step.speculative_devices[k], rng);
+
+		if(not step.speculative_devices[k]->mutations().empty()) {
+			changed_devices.push_back(step.speculative_devices[k]);
+			changed_indices.push_back(k);
+		}
+	}
+
+	// Score every proposal that changed the sequence at once.
+	vector<EvaluatedScoreFunction> tables;
+	vector<double> scores = my_scorefxn->evaluate_many(changed_devices, tables);
+
+	for(int i = 0; i < int(changed_indices.size()); i++) {
+		int const k = changed_indices[i];
+		step.speculative_scores[k] = scores[i];
+		std::swap(step.speculative_tables[k], tables[i]);
+	}
+
+	my_speculative_proposals += num_proposals;
+}
+
+void
+MonteCarlo::finish(MonteCarloStep &step) const {
+	// Give the reporters one last chance to report things.
+	for(auto reporter: my_reporters) {
+		reporter->finish(step);
+	}
+}
+
+int
+MonteCarlo::num_steps() const {
+	return my_steps;
+}
+
+void
+MonteCarlo::num_steps(int num_steps) {
+	my_steps = num_steps;
+}
+
+bool
+MonteCarlo::early_rejection() const {
+	return my_early_rejection;
+}
+
+void
+MonteCarlo::early_rejection(bool enabled) {
+	my_early_rejection = enabled;
+}
+
+int
+MonteCarlo::speculation() const {
+	return my_speculation;
+}
+
+void
+MonteCarlo::speculation(int num_proposals) {
+	if(num_proposals < 1) {
+		throw (f("can't make %d speculative proposals") % num_proposals).str();
+	}
+	my_speculation = num_proposals;
+}
+
+ThermostatPtr
+MonteCarlo::thermostat() const {
+	return my_thermostat;
+}
+
+void
+MonteCarlo::thermostat(ThermostatPtr thermostat) {
+	my_thermostat = thermostat;
+}
+
+ScoreFunctionPtr
+MonteCarlo::scorefxn() const {
+	return my_scorefxn;
+}
+
+void
+MonteCarlo::scorefxn(ScoreFunctionPtr scorefxn) {
+	my_scorefxn = scorefxn;
+}
+
+ScoreFunctionPtr
+MonteCarlo::surrogate_scorefxn() const {
+	return my_surrogate_scorefxn;
+}
+
+void
+MonteCarlo::surrogate_scorefxn(ScoreFunctionPtr surrogate) {
+	my_surrogate_scorefxn = surrogate;
+}
+
+MonteCarloCounters
+MonteCarlo::counters() const {
+	MonteCarloCounters counters;
+	counters.prescreened = my_prescreened;
+	counters.prescreen_rejections = my_prescreen_rejections;
+	counters.prescreen_pf_calls_saved = my_prescreen_pf_calls_saved;
+	counters.speculative_proposals = my_speculative_proposals;
+	counters.speculative_proposals_discarded = my_speculative_proposals_discarded;
+	return counters;
+}
+
+MoveList
+MonteCarlo::moves() const {
+	return my_moves;
+}
+
+void
+MonteCarlo::add_move(MovePtr move) {
+	my_moves.push_back(move);
+}
+
+void
+MonteCarlo::operator+=(MovePtr move) {
+	add_move(move);
+}
+
+ReporterList
+MonteCarlo::reporters() const {
+	return my_reporters;
+}
+
+void
+MonteCarlo::add_reporter(ReporterPtr reporter) {
+	my_reporters.push_back(reporter);
+}
+
+void
+MonteCarlo::operator+=(ReporterPtr reporter) {
+	add_reporter(reporter);
+}
+
+
+ReplicaExchange::ReplicaExchange():
+	my_swap_interval(10),
+	my_num_threads(1) {}
+
+DevicePtr
+ReplicaExchange::apply(DevicePtr device, std::mt19937 &rng) {
+	int const num_replicas = my_replicas.size();
+	if(num_replicas == 0) {
+		return device;
+	}
+
+	for(int k = 0; k < num_replicas; k++) {
+		if(my_replicas[k]->moves().empty()) {
+			throw (f("replica %d has no moves") % k).str();
+		}
+	}
+
+	// Give each replica its own random number generator, seeded in order, so 
+	// that the results don't depend on how the replicas are scheduled.
+	vector<std::mt19937> rngs;
+	for(int k = 0; k < num_replicas; k++) {
+		rngs.emplace_back(rng());
+	}
+
+	vector<MonteCarloStep> steps(num_replicas);
+	my_swap_attempts.assign(num_replicas - 1, 0);
+	my_swap_accepts.assign(num_replicas - 1, 0);
+
+	parallel_for(num_replicas, my_num_threads, [&](int k) {
+			my_replicas[k]->start(steps[k], device->copy(), rngs[k]);
+	});
+
+	// Run every replica for a few steps, then try to swap neighboring replicas.  
+	// Alternate between trying to swap the even and the odd pairs.
+	auto unfinished = [&]() {
+		for(auto const &step: steps) {
+			if(step.i < step.num_steps) return true;
+		}
+		return false;
+	};
+
+	for(int parity = 0; unfinished(); parity = 1 - parity) {
+		parallel_for(num_replicas, my_num_threads, [&](int k) {
+				for(int n = 0; n < my_swap_interval; n++) {
+					if(steps[k].i >= steps[k].num_steps) break;
+					my_replicas[k]->iterate(steps[k], rngs[k]);
+				}
+		});
+
+		// Don't swap once the simulation is over, because the final devices 
+		// wouldn't get a chance to relax at their new temperatures.
+		if(not unfinished()) break;
+
+		attempt_swaps(steps, parity, rng);
+	}
+
+	for(int k = 0; k < num_replicas; k++) {
+		my_replicas[k]->finish(steps[k]);
+	}
+
+	return steps[0].current_device;
+}
+
+void
+ReplicaExchange::attempt_swaps(
+		vector<MonteCarloStep> &steps, int parity, std::mt19937 &rng) {
+
+	for(int k = parity; k + 1 < int(steps.size()); k += 2) {
+		MonteCarloStep &cold = steps[k];
+		MonteCarloStep &hot = steps[k + 1];
+
+		// The score differences are undefined if both devices have the same score 
+		// and one of the temperatures is 0.  Swapping devices with the same score 
+		// doesn't change anything, so just accept.
+		double exponent = (hot.current_score - cold.current_score) *
+			(1 / cold.temperature - 1 / hot.temperature);
+		if(std::isnan(exponent)) {
+			exponent = 0;
+		}
+
+		my_swap_attempts[k]++;
+
+		if(exponent >= 0 or
+				std::uniform_real_distribution<>()(rng) < std::exp(exponent)) {
+			std::swap(cold.current_device, hot.current_device);
+			std::swap(cold.proposed_device, hot.proposed_device);
+			std::swap(cold.current_score, hot.current_score);
+			std::swap(cold.current_surrogate_score, hot.current_surrogate_score);
+			std::swap(cold.score_table, hot.score_table);
+			std::swap(cold.speculative_devices, hot.speculative_devices);
+			std::swap(cold.speculative_moves, hot.speculative_moves);
+			std::swap(cold.speculative_tables, hot.speculative_tables);
+			std::swap(cold.speculative_scores, hot.speculative_scores);
+			std::swap(cold.next_speculation, hot.next_speculation);
+			my_swap_accepts[k]++;
+		}
+	}
+}
+
+vector<MonteCarloPtr>
+ReplicaExchange::replicas() const {
+	return my_replicas;
+}
+
+void
+ReplicaExchange::add_replica(MonteCarloPtr replica) {
+	my_replicas.push_back(replica);
+}
+
+void
+ReplicaExchange::operator+=(MonteCarloPtr replica) {
+	add_replica(replica);
+}
+
+int
+ReplicaExchange::swap_interval() const {
+	return my_swap_interval;
+}
+
+void
+ReplicaExchange::swap_interval(int interval) {
+	if(interval < 1) {
+		throw (f("can't attempt swaps every %d steps") % interval).str();
+	}
+	my_swap_interval = interval;
+}
+
+int
+ReplicaExchange::num_threads() const {
+	return my_num_threads;
+}
+
+void
+ReplicaExchange::num_threads(int num_threads) {
+	if(num_threads < 1) {
+		throw (f("can't run replicas with %d threads") % num_threads).str();
+	}
+	my_num_threads = num_threads;
+}
+
+vector<double>
+ReplicaExchange::swap_acceptance_rates() const {
+	vector<double> rates;
+	for(int k = 0; k < int(my_swap_attempts.size()); k++) {
+		rates.push_back(my_swap_attempts[k]?
+				double(my_swap_accepts[k]) / my_swap_attempts[k] : 0);
+	}
+	return rates;
+}
+
+
+SteepestDescent::SteepestDescent():
+	my_max_steps(std::numeric_limits<int>::max()),
+	my_scorefxn(std::make_shared<ScoreFunction>()),
+	my_reporters(),
+	my_neighbors_scored(0),
+	my_neighbors_reused(0) {}
+
+DevicePtr
+SteepestDescent::apply(DevicePtr device) const {
+	// The neighbors are made by moves that don't use random numbers, but the 
+	// moves still need a generator to be passed to them.
+	std::mt19937 rng;
+
+	// Describe each step of the descent the same way a Monte Carlo simulation 
+	// would, so the same reporters can be used.
+	// If there's no limit on the number of steps, the reporters are told how 
+	// many steps have been taken so far instead.
+	bool const limited = my_max_steps < std::numeric_limits<int>::max();
+
+	MonteCarloStep step;
+	step.i = 0;
+	step.num_steps = limited? my_max_steps : 0;
+	step.current_device = device->copy();
+	step.proposed_device = device->copy();
+	step.current_score = my_scorefxn->evaluate(step.current_device, step.score_table);
+	step.proposed_score = step.current_score;
+	step.score_diff = 0;
+	step.temperature = 0;
+	step.metropolis_criterion = 0;
+	step.random_threshold = 0;
+	step.outcome_counters[OutcomeEnum::REJECT] = 0;
+	step.outcome_counters[OutcomeEnum::ACCEPT_IMPROVED] = 0;
+
+	// Remember the score of every device that's been seen, so that neighbors 
+	// shared by consecutive steps are only scored once.
+	struct Scored {
+		double score;
+		EvaluatedScoreFunction table;
+	};
+	std::unordered_map<Device, Scored> seen;
+	seen[*step.current_device] = {step.current_score, step.score_table};
+
+	for(auto reporter: my_reporters) {
+		reporter->start(step);
+	}
+
+	while(step.i < my_max_steps) {
+		// Make every neighbor of the current device.
+		PositionGraphConstPtr graph = step.current_device->position_graph();
+		MoveList moves;
+		vector<DevicePtr> neighbors;
+
+		for(int position: graph->free_positions()) {
+			for(char base: string("ACGU")) {
+				if(base == step.current_device->raw_seq(position)) continue;
+
+				moves.push_back(std::make_shared<PointMutationMove>(position, base));
+				neighbors.push_back(step.current_device->copy());
+				moves.back()->apply(neighbors.back(), rng);
+			}
+		}
+
+		if(neighbors.empty()) break;
+
+		// Score all the neighbors that haven't been seen before at once.  Linked 
+		// positions can make different moves reach the same neighbor, so make 
+		// sure each one is only scored once.
+		vector<DeviceConstPtr> unseen;
+		std::unordered_set<Device> queued;
+		for(auto const &neighbor: neighbors) {
+			if(seen.count(*neighbor) == 0 and queued.insert(*neighbor).second) {
+				unseen.push_back(neighbor);
+			}
+		}
+
+		vector<EvaluatedScoreFunction> tables;
+		vector<double> scores = my_scorefxn->evaluate_many(unseen, tables);
+
+		for(int i = 0; i < int(unseen.size()); i++) {
+			seen[*unseen[i]] = {scores[i], std::move(tables[i])};
+		}
+
+		my_neighbors_scored += unseen.size();
+		my_neighbors_reused += neighbors.size() - unseen.size();
+
+		// Find the best neighbor.  Ties go to the first one.
+		int best = 0;
+		for(int k = 1; k < int(neighbors.size()); k++) {
+			if(seen.at(*neighbors[k]).score > seen.at(*neighbors[best]).score) {
+				best = k;
+			}
+		}
+
+		Scored const &best_scored = seen.at(*neighbors[best]);
+		step.move = moves[best];
+		step.move->apply(step.proposed_device, rng);
+		step.proposed_score = best_scored.score;
+		step.score_table = best_scored.table;
+		step.score_diff = step.proposed_score - step.current_score;
+
+		// Move to the best neighbor if it's an improvement.  Otherwise, record 
+		// that it was rejected and stop, because this is a local optimum.
+		bool const improved = step.score_diff > 0;
+
+		if(improved) {
+			step.outcome = OutcomeEnum::ACCEPT_IMPROVED;
+			step.current_device->replay_mutations(
+					step.proposed_device->mutations());
+			step.current_score = step.proposed_score;
+		}
+		else {
+			step.outcome = OutcomeEnum::REJECT;
+		}
+
+		step.outcome_counters[step.outcome] += 1;
+		if(not limited) step.num_steps = step.i + 1;
+
+		for(auto reporter: my_reporters) {
+			reporter->update(step);
+		}
+
+		if(improved) {
+			step.proposed_device->forget_mutations();
+		}
+		else {
+			step.proposed_device->undo_mutations();
+		}
+
+		step.i++;
+		if(not improved) break;
+	}
+
+	for(auto reporter: my_reporters) {
+		reporter->finish(step);
+	}
+
+	return step.current_device;
+}
+
+int
+SteepestDescent::max_steps() const {
+	return my_max_steps;
+}
+
+void
+SteepestDescent::max_steps(int max_steps) {
+	my_max_steps = max_steps;
+}
+
+ScoreFunctionPtr
+SteepestDescent::scorefxn() const {
+	return my_scorefxn;
+}
+
+void
+SteepestDescent::scorefxn(ScoreFunctionPtr scorefxn) {
+	my_scorefxn = scorefxn;
+}
+
+SteepestDescentCounters
+SteepestDescent::counters() const {
+	SteepestDescentCounters counters;
+	counters.neighbors_scored = my_neighbors_scored;
+	counters.neighbors_reused = my_neighbors_reused;
+	return counters;
+}
+
+ReporterList
+SteepestDescent::reporters() const {
+	return my_reporters;
+}
 
-	// Get an initial score.
-	step.current_score = my_scorefxn->evaluate(step.current_device, step.score_table);
-	step.proposed_score = step.current_score;
+void
+SteepestDescent::add_reporter(ReporterPtr reporter) {
+	my_reporters.push_back(reporter);
+}
 
-	// Initialize the counters that will keep track of how often moves are 
-	// accepted and rejected.
+void
+SteepestDescent::operator+=(ReporterPtr reporter) {
+	add_reporter(reporter);
+}
+
+
+GeneticAlgorithm::GeneticAlgorithm():
+	my_num_generations(0),
+	my_population_size(50),
+	my_tournament_size(3),
+	my_num_elites(1),
+	my_crossover_rate(0.8),
+	my_mutation_rate(1),
+	my_scorefxn(std::make_shared<ScoreFunction>()),
+	my_moves(),
+	my_reporters(),
+	my_generation_stats() {}
+
+DevicePtr
+GeneticAlgorithm::apply(DevicePtr device, std::mt19937 &rng) {
+	int const num_members = my_population_size;
+
+	if(my_moves.empty()) {
+		throw string("the genetic algorithm has no moves");
+	}
+	if(num_members < 1) {
+		throw (f("can't evolve a population of %d devices") % num_members).str();
+	}
+	if(my_num_elites < 0 or my_num_elites >= num_members) {
+		throw (f("can't keep %d elites from a population of %d devices")
+				% my_num_elites % num_members).str();
+	}
+
+	auto random = [&]() {
+		return std::uniform_real_distribution<>()(rng);
+	};
+	auto randint = [&](int n) {
+		return std::uniform_int_distribution<>(0, n-1)(rng);
+	};
+	auto mutate = [&](DevicePtr child) {
+		my_moves[randint(my_moves.size())]->apply(child, rng);
+		child->forget_mutations();
+	};
+
+	struct Member {
+		DevicePtr device;
+		double score;
+		EvaluatedScoreFunction table;
+	};
+	vector<Member> population(num_members);
+	my_generation_stats.clear();
+
+	// Score the new members of the population (i.e. everything but the 
+	// elites) at once, put the population in order from best to worst, and 
+	// record how the generation turned out.
+	auto evaluate = [&](int first_new, std::chrono::steady_clock::time_point start) {
+		vector<DeviceConstPtr> devices;
+		for(int k = first_new; k < num_members; k++) {
+			devices.push_back(population[k].device);
+		}
+
+		vector<EvaluatedScoreFunction> tables;
+		vector<double> scores = my_scorefxn->evaluate_many(devices, tables);
+
+		for(int k = first_new; k < num_members; k++) {
+			population[k].score = scores[k - first_new];
+			population[k].table = std::move(tables[k - first_new]);
+		}
+
+		std::stable_sort(population.begin(), population.end(),
+				[](Member const &a, Member const &b) { return a.score > b.score; });
+
+		GenerationStats stats;
+		stats.best_score = population[0].score;
+		stats.num_scored = devices.size();
+
+		for(auto const &member: population) {
+			stats.mean_score += member.score / num_members;
+		}
+
+		// The diversity is the Hamming distance between every pair of members, 
+		// averaged over pairs and positions.
+		int const len = device->raw_len();
+		long num_differences = 0;
+		for(int a = 0; a < num_members; a++) {
+			string seq_a = population[a].device->raw_seq();
+			for(int b = a + 1; b < num_members; b++) {
+				string seq_b = population[b].device->raw_seq();
+				for(int i = 0; i < len; i++) {
+					num_differences += seq_a[i] != seq_b[i];
+				}
+			}
+		}
+		long const num_pairs = long(num_members) * (num_members - 1) / 2;
+		stats.diversity = (num_pairs and len)?
+			double(num_differences) / num_pairs / len : 0;
+
+		std::chrono::duration<double> elapsed = 
+			std::chrono::steady_clock::now() - start;
+		stats.seconds = elapsed.count();
+
+		my_generation_stats.push_back(stats);
+	};
+
+	// Start with the given device and mutants of it.
+	auto start = std::chrono::steady_clock::now();
+
+	for(int k = 0; k < num_members; k++) {
+		population[k].device = device->copy();
+		if(k > 0) mutate(population[k].device);
+	}
+	evaluate(0, start);
+
+	// Describe each generation as a step in a Monte Carlo simulation, so the 
+	// same reporters can be used.
+	MonteCarloStep step;
+	step.i = 0;
+	step.num_steps = my_num_generations;
+	step.current_device = population[0].device->copy();
+	step.proposed_device = population[0].device;
+	step.current_score = population[0].score;
+	step.proposed_score = population[0].score;
+	step.score_table = population[0].table;
+	step.score_diff = 0;
+	step.temperature = 0;
+	step.metropolis_criterion = 0;
+	step.random_threshold = 0;
 	step.outcome_counters[OutcomeEnum::REJECT] = 0;
-	step.outcome_counters[OutcomeEnum::ACCEPT_WORSENED] = 0;
 	step.outcome_counters[OutcomeEnum::ACCEPT_UNCHANGED] = 0;
 	step.outcome_counters[OutcomeEnum::ACCEPT_IMPROVED] = 0;
 
-	// Initialize the reporters
 	for(auto reporter: my_reporters) {
 		reporter->start(step);
 	}
 
-	for(step.i = 0; step.i < step.num_steps; step.i++) {
-		// Get the temperature for the Metropolis criterion.  This has to be done 
-		// every iteration, even if no accept/reject decision needs to be made.
+	// Pick the best of a few random members.
+	auto tournament = [&]() -> DeviceConstPtr {
+		int winner = randint(num_members);
+		for(int n = 1; n < my_tournament_size; n++) {
+			int challenger = randint(num_members);
+			if(population[challenger].score > population[winner].score) {
+				winner = challenger;
+			}
+		}
+		return population[winner].device;
+	};
 
-		step.temperature = my_thermostat->adjust(step);
+	while(step.i < step.num_steps) {
+		start = std::chrono::steady_clock::now();
 
-		// Copy the sgRNA so we can easily undo the move.
-		step.proposed_device = step.current_device->copy();
+		// The population is in order, so the elites are already at the front.  
+		// Make every child before replacing anyone, so that every parent comes 
+		// from the previous generation.
+		vector<DevicePtr> children;
 
-		// Randomly pick a move to apply.
-		step.move = my_moves[randmove()];
-		step.move->apply(step.proposed_device, rng);
+		for(int k = my_num_elites; k < num_members; k++) {
+			DeviceConstPtr parent = tournament();
+			DevicePtr child = (random() < my_crossover_rate)?
+				crossover(parent, tournament(), rng) : parent->copy();
 
-		// Skip the score function evaluation if the sequence didn't change.
-		if(step.current_device->seq() == step.proposed_device->seq()) {
-			step.outcome = OutcomeEnum::ACCEPT_UNCHANGED;
+			if(random() < my_mutation_rate) {
+				mutate(child);
+			}
+			children.push_back(child);
 		}
 
-		// Score the proposed move, then either accept or reject it.
+		for(int k = my_num_elites; k < num_members; k++) {
+			population[k].device = children[k - my_num_elites];
+		}
+		evaluate(my_num_elites, start);
+
+		// Report the best device in this generation, and the best one so far.
+		step.proposed_device = population[0].device;
+		step.proposed_score = population[0].score;
+		step.score_table = population[0].table;
+		step.score_diff = step.proposed_score - step.current_score;
+
+		if(step.score_diff > 0) {
+			step.outcome = OutcomeEnum::ACCEPT_IMPROVED;
+			step.current_device = population[0].device->copy();
+			step.current_score = population[0].score;
+		}
 		else {
-			step.proposed_score = my_scorefxn->evaluate(step.proposed_device, step.score_table);
-			step.score_diff = step.proposed_score - step.current_score;
-			step.metropolis_criterion = std::exp(step.score_diff / step.temperature);
-			step.random_threshold = random();
-
-			if(step.metropolis_criterion < step.random_threshold) {
-				step.outcome = OutcomeEnum::REJECT;
-			}
-			else{
-				step.outcome = (step.score_diff > 0)?
-					OutcomeEnum::ACCEPT_IMPROVED : OutcomeEnum::ACCEPT_WORSENED;
-
-				step.current_device = step.proposed_device;
-				step.current_score = step.proposed_score;
-			}
+			step.outcome = (step.score_diff == 0)?
+				OutcomeEnum::ACCEPT_UNCHANGED : OutcomeEnum::REJECT;
 		}
 
-		// Update the accept/reject statistics.
 		step.outcome_counters[step.outcome] += 1;
 
-		// Give the reporters a chance to react to the move.
 		for(auto reporter: my_reporters) {
 			reporter->update(step);
 		}
+
+		step.i++;
 	}
 
-	// Give the reporters one last chance to report things.
 	for(auto reporter: my_reporters) {
 		reporter->finish(step);
 	}
@@ -106,72 +1039,441 @@ MonteCarlo::apply(DevicePtr device, std::mt19937 &rng) const {
 	return step.current_device;
 }
 
+DevicePtr
+GeneticAlgorithm::crossover(
+		DeviceConstPtr mother, DeviceConstPtr father, std::mt19937 &rng) const {
+
+	DevicePtr child = mother->copy();
+	PositionGraphConstPtr graph = mother->position_graph();
+	vector<bool> crossed(mother->raw_len(), false);
+
+	// Each free position belongs to one group of linked positions, but a group 
+	// can have more than one free position, so keep track of which groups have 
+	// already been decided.
+	for(int position: graph->free_positions()) {
+		if(crossed[position]) continue;
+
+		bool const from_father = std::uniform_int_distribution<>(0, 1)(rng);
+
+		for(int linked: graph->component(position)) {
+			crossed[linked] = true;
+			if(from_father) {
+				child->mutate(linked, father->raw_seq(linked));
+			}
+		}
+	}
+
+	child->forget_mutations();
+	return child;
+}
+
 int
-MonteCarlo::num_steps() const {
-	return my_steps;
+GeneticAlgorithm::num_generations() const {
+	return my_num_generations;
 }
 
 void
-MonteCarlo::num_steps(int num_steps) {
-	my_steps = num_steps;
+GeneticAlgorithm::num_generations(int num_generations) {
+	my_num_generations = num_generations;
 }
 
-ThermostatPtr
-MonteCarlo::thermostat() const {
-	return my_thermostat;
+int
+GeneticAlgorithm::population_size() const {
+	return my_population_size;
 }
 
 void
-MonteCarlo::thermostat(ThermostatPtr thermostat) {
-	my_thermostat = thermostat;
+GeneticAlgorithm::population_size(int population_size) {
+	my_population_size = population_size;
+}
+
+int
+GeneticAlgorithm::tournament_size() const {
+	return my_tournament_size;
+}
+
+void
+GeneticAlgorithm::tournament_size(int tournament_size) {
+	if(tournament_size < 1) {
+		throw (f("can't hold tournaments with %d devices") % tournament_size).str();
+	}
+	my_tournament_size = tournament_size;
+}
+
+int
+GeneticAlgorithm::num_elites() const {
+	return my_num_elites;
+}
+
+void
+GeneticAlgorithm::num_elites(int num_elites) {
+	my_num_elites = num_elites;
+}
+
+double
+GeneticAlgorithm::crossover_rate() const {
+	return my_crossover_rate;
+}
+
+void
+GeneticAlgorithm::crossover_rate(double rate) {
+	my_crossover_rate = rate;
+}
+
+double
+GeneticAlgorithm::mutation_rate() const {
+	return my_mutation_rate;
+}
+
+void
+GeneticAlgorithm::mutation_rate(double rate) {
+	my_mutation_rate = rate;
 }
 
 ScoreFunctionPtr
-MonteCarlo::scorefxn() const {
+GeneticAlgorithm::scorefxn() const {
 	return my_scorefxn;
 }
 
 void
-MonteCarlo::scorefxn(ScoreFunctionPtr scorefxn) {
+GeneticAlgorithm::scorefxn(ScoreFunctionPtr scorefxn) {
 	my_scorefxn = scorefxn;
 }
 
 MoveList
-MonteCarlo::moves() const {
+GeneticAlgorithm::moves() const {
 	return my_moves;
 }
 
 void
-MonteCarlo::add_move(MovePtr move) {
+GeneticAlgorithm::add_move(MovePtr move) {
 	my_moves.push_back(move);
 }
 
 void
-MonteCarlo::operator+=(MovePtr move) {
+GeneticAlgorithm::operator+=(MovePtr move) {
 	add_move(move);
 }
 
 ReporterList
-MonteCarlo::reporters() const {
+GeneticAlgorithm::reporters() const {
 	return my_reporters;
 }
 
 void
-MonteCarlo::add_reporter(ReporterPtr reporter) {
+GeneticAlgorithm::add_reporter(ReporterPtr reporter) {
 	my_reporters.push_back(reporter);
 }
 
 void
-MonteCarlo::operator+=(ReporterPtr reporter) {
+GeneticAlgorithm::operator+=(ReporterPtr reporter) {
+	add_reporter(reporter);
+}
+
+vector<GenerationStats> const &
+GeneticAlgorithm::generation_stats() const {
+	return my_generation_stats;
+}
+
+
+PopulationAnnealing::PopulationAnnealing():
+	my_temperatures({1}),
+	my_population_size(100),
+	my_steps_per_temperature(10),
+	my_num_threads(1),
+	my_scorefxn(std::make_shared<ScoreFunction>()),
+	my_moves(),
+	my_reporters(),
+	my_annealing_stats() {}
+
+DevicePtr
+PopulationAnnealing::apply(DevicePtr device, std::mt19937 &rng) {
+	int const num_walkers = my_population_size;
+	int const num_temperatures = my_temperatures.size();
+
+	if(my_moves.empty()) {
+		throw string("population annealing has no moves");
+	}
+	if(num_walkers < 1) {
+		throw (f("can't anneal a population of %d walkers") % num_walkers).str();
+	}
+
+	// Every walker is moved by the same sampler.  Its thermostat is set to each 
+	// temperature in turn, and isn't changed while the walkers are moving.
+	auto thermostat = std::make_shared<FixedThermostat>(my_temperatures[0]);
+
+	MonteCarlo sampler;
+	sampler.scorefxn(my_scorefxn);
+	sampler.thermostat(thermostat);
+	sampler.num_steps(num_temperatures * my_steps_per_temperature);
+	for(auto move: my_moves) {
+		sampler += move;
+	}
+
+	vector<MonteCarloStep> walkers(num_walkers);
+	vector<std::mt19937> rngs(num_walkers);
+	vector<int> families(num_walkers);
+
+	auto reseed = [&]() {
+		for(auto &walker_rng: rngs) {
+			walker_rng.seed(rng());
+		}
+	};
+
+	// Make a walker that continues from the given one, but with its own copies 
+	// of the devices and its own random numbers (drawn the same way 
+	// MonteCarlo::start() would draw them).
+	auto clone = [&](MonteCarloStep const &parent, std::mt19937 &walker_rng) {
+		MonteCarloStep child = parent;
+		child.current_device = parent.current_device->copy();
+		child.proposed_device = parent.proposed_device->copy();
+		child.move_rng = walker_rng;
+		child.threshold_rng = walker_rng;
+		child.speculative_devices.clear();
+		child.speculative_moves.clear();
+		child.next_speculation = 0;
+		return child;
+	};
+
+	// The walkers all start out the same, so only score the device once.
+	reseed();
+	sampler.start(walkers[0], device, rngs[0]);
+	for(int k = 1; k < num_walkers; k++) {
+		walkers[k] = clone(walkers[0], rngs[k]);
+	}
+	for(int k = 0; k < num_walkers; k++) {
+		families[k] = k;
+	}
+
+	// Describe each temperature as a step in a Monte Carlo simulation, so the 
+	// same reporters can be used.
+	MonteCarloStep report = walkers[0];
+	report.i = 0;
+	report.num_steps = num_temperatures;
+	report.move = nullptr;
+	report.score_diff = 0;
+	report.temperature = my_temperatures[0];
+	report.metropolis_criterion = 0;
+	report.random_threshold = 0;
+	report.outcome = OutcomeEnum::ACCEPT_UNCHANGED;
+
+	for(auto reporter: my_reporters) {
+		reporter->start(report);
+	}
+
+	my_annealing_stats.clear();
+	double free_energy = 0;
+	double effective_size = num_walkers;
+
+	for(int t = 0; t < num_temperatures; t++) {
+		double const temperature = my_temperatures[t];
+
+		// Reweight the walkers for the new temperature.  The weights are kept 
+		// relative to the biggest one, so nothing overflows.
+		if(t > 0) {
+			double const delta_beta = 1 / temperature - 1 / my_temperatures[t-1];
+			vector<double> log_weights(num_walkers);
+			for(int k = 0; k < num_walkers; k++) {
+				log_weights[k] = walkers[k].current_score * delta_beta;
+			}
+			double const max_log_weight = 
+				*std::max_element(log_weights.begin(), log_weights.end());
+
+			vector<double> weights(num_walkers);
+			double sum = 0, sum_of_squares = 0;
+			for(int k = 0; k < num_walkers; k++) {
+				weights[k] = std::exp(log_weights[k] - max_log_weight);
+				sum += weights[k];
+				sum_of_squares += weights[k] * weights[k];
+			}
+
+			free_energy -= max_log_weight + log(sum / num_walkers);
+			effective_size = sum * sum / sum_of_squares;
+
+			// Resample the walkers.  Systematic resampling uses one random number 
+			// for the whole population, and copies each walker either the floor 
+			// or the ceiling of its expected number of times.
+			vector<int> parents;
+			double const offset = std::uniform_real_distribution<>()(rng);
+			double cumulative_weight = weights[0];
+			int parent = 0;
+
+			for(int k = 0; k < num_walkers; k++) {
+				double const target = (offset + k) / num_walkers * sum;
+				while(parent < num_walkers - 1 and cumulative_weight <= target) {
+					cumulative_weight += weights[++parent];
+				}
+				parents.push_back(parent);
+			}
+
+			reseed();
+			vector<MonteCarloStep> children(num_walkers);
+			vector<int> child_families(num_walkers);
+			for(int k = 0; k < num_walkers; k++) {
+				children[k] = clone(walkers[parents[k]], rngs[k]);
+				child_families[k] = families[parents[k]];
+			}
+			walkers.swap(children);
+			families.swap(child_families);
+		}
+
+		// Move every walker at the new temperature.
+		thermostat->temperature(temperature);
+
+		parallel_for(num_walkers, my_num_threads, [&](int k) {
+				for(int n = 0; n < my_steps_per_temperature; n++) {
+					sampler.iterate(walkers[k], rngs[k]);
+				}
+		});
+
+		// Record how the population looks at this temperature.
+		int best = 0;
+		AnnealingStats stats;
+		stats.temperature = temperature;
+		stats.free_energy = free_energy;
+		stats.effective_size = effective_size;
+
+		for(int k = 0; k < num_walkers; k++) {
+			stats.mean_score += walkers[k].current_score / num_walkers;
+			if(walkers[k].current_score > walkers[best].current_score) best = k;
+		}
+		stats.best_score = walkers[best].current_score;
+		stats.num_families = 
+			std::set<int>(families.begin(), families.end()).size();
+
+		my_annealing_stats.push_back(stats);
+
+		// The walkers only keep the table for their last proposed move, so the 
+		// best device has to be rescored to report its terms.
+		if(not my_reporters.empty()) {
+			report.i = t;
+			report.temperature = temperature;
+			report.current_device = walkers[best].current_device;
+			report.proposed_device = walkers[best].current_device;
+			report.score_diff = stats.best_score - report.current_score;
+			report.current_score = stats.best_score;
+			report.proposed_score = stats.best_score;
+			my_scorefxn->evaluate(report.current_device, report.score_table);
+
+			for(auto reporter: my_reporters) {
+				reporter->update(report);
+			}
+		}
+	}
+
+	for(auto reporter: my_reporters) {
+		reporter->finish(report);
+	}
+
+	int best = 0;
+	for(int k = 1; k < num_walkers; k++) {
+		if(walkers[k].current_score > walkers[best].current_score) best = k;
+	}
+	return walkers[best].current_device->copy();
+}
+
+vector<double>
+PopulationAnnealing::temperatures() const {
+	return my_temperatures;
+}
+
+void
+PopulationAnnealing::temperatures(vector<double> temperatures) {
+	if(temperatures.empty()) {
+		throw string("population annealing needs at least one temperature");
+	}
+	for(double temperature: temperatures) {
+		if(temperature <= 0) {
+			throw (f("can't anneal at T=%g") % temperature).str();
+		}
+	}
+	my_temperatures = temperatures;
+}
+
+int
+PopulationAnnealing::population_size() const {
+	return my_population_size;
+}
+
+void
+PopulationAnnealing::population_size(int population_size) {
+	my_population_size = population_size;
+}
+
+int
+PopulationAnnealing::steps_per_temperature() const {
+	return my_steps_per_temperature;
+}
+
+void
+PopulationAnnealing::steps_per_temperature(int num_steps) {
+	my_steps_per_temperature = num_steps;
+}
+
+int
+PopulationAnnealing::num_threads() const {
+	return my_num_threads;
+}
+
+void
+PopulationAnnealing::num_threads(int num_threads) {
+	if(num_threads < 1) {
+		throw (f("can't move walkers with %d threads") % num_threads).str();
+	}
+	my_num_threads = num_threads;
+}
+
+ScoreFunctionPtr
+PopulationAnnealing::scorefxn() const {
+	return my_scorefxn;
+}
+
+void
+PopulationAnnealing::scorefxn(ScoreFunctionPtr scorefxn) {
+	my_scorefxn = scorefxn;
+}
+
+MoveList
+PopulationAnnealing::moves() const {
+	return my_moves;
+}
+
+void
+PopulationAnnealing::add_move(MovePtr move) {
+	my_moves.push_back(move);
+}
+
+void
+PopulationAnnealing::operator+=(MovePtr move) {
+	add_move(move);
+}
+
+ReporterList
+PopulationAnnealing::reporters() const {
+	return my_reporters;
+}
+
+void
+PopulationAnnealing::add_reporter(ReporterPtr reporter) {
+	my_reporters.push_back(reporter);
+}
+
+void
+PopulationAnnealing::operator+=(ReporterPtr reporter) {
 	add_reporter(reporter);
 }
 
+vector<AnnealingStats> const &
+PopulationAnnealing::annealing_stats() const {
+	return my_annealing_stats;
+}
+
 
 bool
 can_be_mutated(DeviceConstPtr device, int position) {
 	// Only mutate positions that are upper case.  This is a simple way for the 
 	// user to indicate which positions should be mutable.
-	return isupper(device->seq()[position]);
+	return isupper(device->seq(position));
 }
 
 bool
@@ -182,9 +1484,14 @@ can_be_freely_mutated(DeviceConstPtr device, int position) {
 
 	// Don't mutate positions that are constrained to be the 3' end of a base 
 	// pair.  We don't want to over-sample these positions, and they'll be 
-	// mutated as a unit with their partner.
-	for(auto /*pair*/ macrostate: device->macrostates()) {
-		if(macrostate.second[position] == ')') {
+	// mutated as a unit with their partner.  The macrostates don't include the 
+	// context, so the position has to be adjusted.
+	int raw_position = position - device->context()->before().length();
+	if(raw_position < 0 or raw_position >= device->raw_len()) {
+		return true;
+	}
+	for(auto const &macrostate: *device->macrostate_table()) {
+		if(macrostate.second[raw_position] == ')') {
 			return false;
 		}
 	}
@@ -220,8 +1527,8 @@ mutate_recursively(
 	// Recursively make complementary mutations in any position constrained to be 
 	// base paired to this one.  GU base pairs are not considered because they 
 	// would necessarily cause a bias in the final nucleotide distribution.
-	for(auto item: device->macrostates()) {
-		string macrostate = item.second;
+	for(auto const &item: *device->macrostate_table()) {
+		string const &macrostate = item.second;
 		char open_symbol, close_symbol;
 		int step;
 
@@ -272,7 +1579,7 @@ mutate_recursively(
 			mutate_recursively(
 					device, partner, complementary_mutation, already_mutated);
 		}
-		else if(device->seq()[partner] != complementary_mutation) {
+		else if(device->raw_seq(partner) != complementary_mutation) {
 			// I can't think of a way to trigger this condition (programming errors 
 			// excluded), but I'm not yet convinced that there isn't a way.  If I 
 			// were, I would've made this an assertion rather than an exception.
@@ -282,24 +1589,81 @@ mutate_recursively(
 }
 
 
+void
+mutate_linked_positions(
+		DevicePtr device,
+		int const position,
+		char const mutation) {
+
+	PositionGraphConstPtr graph = device->position_graph();
+
+	for(int partner: graph->component(position)) {
+		device->mutate(partner, graph->complementary(position, partner)?
+				COMPLEMENTARY_NUCS.at(mutation) : mutation);
+	}
+}
+
+
 UnbiasedMutationMove::UnbiasedMutationMove() {}
 
 void
 UnbiasedMutationMove::apply(DevicePtr device, std::mt19937 &rng) const {
-	// Make a list of the positions that can be mutated.
-	vector<int> mutable_positions;
-	for(int i = 0; i < device->len(); i++) {
-		if(can_be_freely_mutated(device, i)) {
-			mutable_positions.push_back(i);
-		}
-	}
+	// The positions that can be mutated are worked out once, when the device's 
+	// position graph is compiled.
+	vector<int> const &mutable_positions =
+		device->position_graph()->free_positions();
 
 	// Mutate a randomly chosen position to a randomly chosen base.
 	int random_i = mutable_positions[
 		std::uniform_int_distribution<>(0, mutable_positions.size()-1)(rng)];
 	char random_acgu = "ACGU"[std::uniform_int_distribution<>(0, 3)(rng)];
 
-	mutate_recursively(device, random_i, random_acgu);
+	mutate_linked_positions(device, random_i, random_acgu);
+}
+
+HeatBathMove::HeatBathMove() {}
+
+void
+HeatBathMove::apply(DevicePtr device, std::mt19937 &rng) const {
+	UnbiasedMutationMove().apply(device, rng);
+}
+
+vector<DevicePtr>
+HeatBathMove::heat_bath_options(
+		DeviceConstPtr device, std::mt19937 &rng) const {
+
+	vector<int> const &mutable_positions =
+		device->position_graph()->free_positions();
+
+	int random_i = mutable_positions[
+		std::uniform_int_distribution<>(0, mutable_positions.size()-1)(rng)];
+
+	// The option that doesn't change anything is included, so that staying 
+	// put has the right probability.
+	vector<DevicePtr> options;
+	for(char base: string("ACGU")) {
+		options.push_back(device->copy());
+		mutate_linked_positions(options.back(), random_i, base);
+	}
+	return options;
+}
+
+PointMutationMove::PointMutationMove(int position, char base):
+	my_position(position), my_base(base) {}
+
+void
+PointMutationMove::apply(DevicePtr device, std::mt19937 &) const {
+	mutate_linked_positions(device, my_position, my_base);
+}
+
+int
+PointMutationMove::position() const {
+	return my_position;
+}
+
+char
+PointMutationMove::base() const {
+	return my_base;
 }
 
 FixedThermostat::FixedThermostat(double temperature):
@@ -380,8 +1744,11 @@ AutoScalingThermostat::AutoScalingThermostat(
 
 double
 AutoScalingThermostat::adjust(MonteCarloStep const &step) {
-	// Add the new score difference to the training set.
-	my_training_set.push_back(step.score_diff);
+	// Add the new score difference to the training set.  Moves that weren't 
+	// scored exactly (e.g. rejected by a prescreen) don't have one.
+	if(not std::isnan(step.score_diff)) {
+		my_training_set.push_back(step.score_diff);
+	}
 
 	// Once we've acquired a certain amount of training data, calculate a new 
 	// temperature by finding the median score difference and solving for the 
@@ -445,9 +1812,9 @@ TsvTrajectoryReporter::start(MonteCarloStep const & step) {
 	my_tsv << "current_score\t";
 	my_tsv << "proposed_score\t";
 
-	for(auto row: step.score_table) {
-		my_tsv << f("term_weight[%s]") % row.name << "\t";
-		my_tsv << f("term_value[%s]") % row.name << "\t";
+	for(string const &name: step.score_table.schema->names) {
+		my_tsv << f("term_weight[%s]") % name << "\t";
+		my_tsv << f("term_value[%s]") % name << "\t";
 	}
 
 	my_tsv << "score_diff\t";
@@ -470,16 +1837,23 @@ TsvTrajectoryReporter::update(MonteCarloStep const &step) {
 		my_tsv << step.current_score << "\t";
 		my_tsv << step.proposed_score << "\t";
 
-		for(auto row: step.score_table) {
-			my_tsv << row.weight << "\t";
-			my_tsv << row.term << "\t";
+		// Moves that weren't scored exactly (e.g. rejected by a prescreen) still 
+		// get a row, because the current device is still a sample, but their 
+		// proposed score and terms are left as NaN.
+		bool const unscored = std::isnan(step.score_diff);
+		ScoreSchema const &schema = *step.score_table.schema;
+		for(int row = 0; row < schema.size(); row++) {
+			my_tsv << schema.weights[row] << "\t";
+			my_tsv << (unscored?
+					std::numeric_limits<double>::quiet_NaN() :
+					step.score_table.values[row]) << "\t";
 		}
 
 		my_tsv << step.score_diff << "\t";
 		my_tsv << step.temperature << "\t";
 		my_tsv << step.metropolis_criterion << "\t";
 		my_tsv << step.random_threshold << "\t";
-		my_tsv << step.move->name() << "\t";
+		my_tsv << (step.move? step.move->name() : "None") << "\t";
 		my_tsv << step.outcome << "\t";
 		my_tsv << step.current_device->seq() << "\t";
 		my_tsv << step.proposed_device->seq() << "\t";
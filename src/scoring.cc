@@ -1,10 +1,17 @@
 #include <algorithm>
+#include <cassert>
+#include <chrono>
 #include <cmath>
+#include <limits>
+#include <numeric>
+#include <set>
 
 #include <boost/algorithm/string.hpp>
 
 extern "C" {
   #include <ViennaRNA/structure_utils.h>
+  #include <ViennaRNA/dp_matrices.h>
+  #include <ViennaRNA/params.h>
   #include <ViennaRNA/part_func.h>
   #include <ViennaRNA/fold.h>
 	#include <ViennaRNA/constraints.h>
@@ -14,12 +21,234 @@ extern "C" {
 
 namespace addapt {
 
-ViennaRnaFold::ViennaRnaFold(DeviceConstPtr device, AptamerConstPtr aptamer):
+FoldParameters::FoldParameters() {
+	for(bool compute_bppm: {false, true}) {
+		// Tell ViennaRNA not to calculate the base-pair probability matrix (BPPM) 
+		// if we won't be using it.
+		vrna_md_t &md = my_md[compute_bppm];
+		vrna_md_set_default(&md);
+		md.backtrack = compute_bppm;
+		md.compute_bpp = compute_bppm;
+
+		my_exp_params[compute_bppm] = vrna_exp_params(&md);
+	}
+}
+
+FoldParameters::~FoldParameters() {
+	for(auto exp_params: my_exp_params) {
+		free(exp_params);
+	}
+}
+
+FoldParameters const &
+FoldParameters::shared() {
+	static FoldParameters parameters;
+	return parameters;
+}
+
+vrna_md_t const &
+FoldParameters::model_details(bool compute_bppm) const {
+	return my_md[compute_bppm];
+}
+
+vrna_fold_compound_t *
+FoldParameters::make_fold_compound(string const &seq, bool compute_bppm) const {
+	vrna_md_t md = my_md[compute_bppm];
+
+	// Don't ask for VRNA_OPTION_PF here, because that would make ViennaRNA 
+	// derive its own Boltzmann factors.  Instead, copy in the shared factors 
+	// (which also scales them for the length of the sequence) and then add the 
+	// partition function matrices.
+	vrna_fold_compound_t *fc =
+		vrna_fold_compound(seq.c_str(), &md, VRNA_OPTION_DEFAULT);
+
+	vrna_exp_params_subst(fc, my_exp_params[compute_bppm]);
+	vrna_mx_pf_add(fc, VRNA_MX_DEFAULT, VRNA_OPTION_PF);
+	vrna_exp_params_rescale(fc, NULL);
+
+	return fc;
+}
+
+
+std::atomic<long> FoldCompoundPool::our_allocations(0);
+std::atomic<long> FoldCompoundPool::our_reuses(0);
+std::atomic<long> FoldCompoundPool::our_bytes(0);
+std::atomic<long> FoldCompoundPool::our_peak_bytes(0);
+
+FoldCompoundPool::~FoldCompoundPool() {
+	clear();
+}
+
+FoldCompoundPool &
+FoldCompoundPool::local() {
+	static thread_local FoldCompoundPool pool;
+	return pool;
+}
+
+vrna_fold_compound_t *
+FoldCompoundPool::acquire(string const &seq, bool compute_bppm) {
+	auto it = my_idle_fcs.find({seq, compute_bppm});
+
+	// Recycle an idle fold compound, if there is one for the same sequence.
+	if(it != my_idle_fcs.end()) {
+		vrna_fold_compound_t *fc = it->second;
+		my_idle_fcs.erase(it);
+		reset(fc);
+		our_reuses++;
+		return fc;
+	}
+
+	// Otherwise, free any idle fold compounds that were left behind by older 
+	// versions of this sequence, then allocate a new one.
+	evict([&](Key const &key) {
+		return key.first.length() == seq.length() and key.second == compute_bppm;
+	});
+
+	vrna_fold_compound_t *fc =
+		FoldParameters::shared().make_fold_compound(seq, compute_bppm);
+
+	our_allocations++;
+	atomic_max(our_peak_bytes, our_bytes += dp_bytes(fc));
+	return fc;
+}
+
+void
+FoldCompoundPool::release(vrna_fold_compound_t *fc) {
+	bool compute_bppm = fc->params->model_details.compute_bpp;
+	my_idle_fcs.insert({{fc->sequence, compute_bppm}, fc});
+}
+
+void
+FoldCompoundPool::clear() {
+	evict([](Key const &) { return true; });
+}
+
+template <typename Predicate>
+void
+FoldCompoundPool::evict(Predicate should_evict) {
+	for(auto it = my_idle_fcs.begin(); it != my_idle_fcs.end(); ) {
+		if(should_evict(it->first)) {
+			our_bytes -= dp_bytes(it->second);
+			vrna_fold_compound_free(it->second);
+			it = my_idle_fcs.erase(it);
+		}
+		else {
+			++it;
+		}
+	}
+}
+
+int
+FoldCompoundPool::size() const {
+	return my_idle_fcs.size();
+}
+
+FoldCompoundPoolCounters
+FoldCompoundPool::counters() {
+	FoldCompoundPoolCounters counters;
+	counters.allocations = our_allocations;
+	counters.reuses = our_reuses;
+	counters.bytes = our_bytes;
+	counters.peak_bytes = our_peak_bytes;
+	return counters;
+}
+
+void
+FoldCompoundPool::reset_counters() {
+	our_allocations = 0;
+	our_reuses = 0;
+	our_peak_bytes = long(our_bytes);
+}
+
+DpMemoryTracker::DpMemoryTracker():
+	my_bytes(0), my_peak_bytes(0) {}
+
+void
+DpMemoryTracker::acquire(long bytes) {
+	atomic_max(my_peak_bytes, my_bytes += bytes);
+}
+
+void
+DpMemoryTracker::release(long bytes) {
+	my_bytes -= bytes;
+}
+
+long
+DpMemoryTracker::bytes() const {
+	return my_bytes;
+}
+
+long
+DpMemoryTracker::peak_bytes() const {
+	return my_peak_bytes;
+}
+
+long
+FoldCompoundPool::dp_bytes(vrna_fold_compound_t const *fc) {
+	// The partition function needs four triangular matrices (q, qb, qm, qm1), 
+	// plus one more for the base-pair probabilities if they're being 
+	// calculated.  The linear arrays (q1k, qln, scale, expMLbase) are included 
+	// for completeness.
+	long n = fc->length;
+	long num_matrices = fc->params->model_details.compute_bpp? 5 : 4;
+	long triangle = (n + 1) * (n + 2) / 2;
+	return sizeof(FLT_OR_DBL) * (num_matrices * triangle + 4 * (n + 2));
+}
+
+void
+FoldCompoundPool::reset(vrna_fold_compound_t *fc) {
+	// Remove any constraints left over from the previous calculation.
+	vrna_hc_init(fc);
+	vrna_sc_remove(fc);
+}
+
+
+double
+RnaFold::macrostate_prob(HardConstraint const &constraint) const {
+	return macrostate_prob(constraint.dot_bracket());
+}
+
+double
+RnaFold::macrostate_mfe_prob(HardConstraint const &constraint) const {
+	return macrostate_prob(constraint);
+}
+
+RnaFold const &
+fold_for(
+		ConditionEnum condition,
+		RnaFold const &apo_fold,
+		RnaFold const &holo_fold) {
+
+	switch(condition) {
+		case ConditionEnum::APO: return apo_fold;
+		case ConditionEnum::HOLO: return holo_fold;
+	}
+	throw (f("unknown condition: %d") % int(condition)).str();
+}
+
+
+std::atomic<long> ViennaRnaFold::our_pf_calls(0);
+std::atomic<long> ViennaRnaFold::our_pf_calls_saved(0);
+std::atomic<long> ViennaRnaFold::our_pf_calls_skipped(0);
+std::atomic<long> ViennaRnaFold::our_mfe_calls(0);
+std::atomic<long> ViennaRnaFold::our_peak_bytes(0);
+
+ViennaRnaFold::ViennaRnaFold(
+		DeviceConstPtr device,
+		AptamerConstPtr aptamer,
+		DpMemoryTracker *memory):
 
 	my_device(device),
 	my_aptamer(aptamer),
 	my_seq(device->seq()),
-	my_bppm_fc(nullptr) {
+	my_bppm_fc(nullptr),
+	my_bytes(0),
+	my_pf_calls(0),
+	my_memory(memory),
+	my_g_tot(0),
+	my_g_tot_cached(false),
+	my_g_mfe(0),
+	my_g_mfe_cached(false) {
 
 	// Upper-casing the sequence is critically important!  Without this step, 
 	// ViennaRNA will silently produce incorrect results.  I realized I needed to 
@@ -29,8 +258,8 @@ ViennaRnaFold::ViennaRnaFold(DeviceConstPtr device, AptamerConstPtr aptamer):
 }
 
 ViennaRnaFold::~ViennaRnaFold() {
-	for(auto fc: my_fcs) {
-		vrna_fold_compound_free(fc);
+	if(my_bppm_fc) {
+		release_fold_compound(my_bppm_fc);
 	}
 }
 
@@ -38,9 +267,11 @@ double
 ViennaRnaFold::base_pair_prob(int a, int b) const {
 	// Perform the partition function calculation if this is the first time a 
 	// base-pair probability is being requested.  Cache the result.
+	// The unconstrained free energy comes for free, so remember it too.
 	if(my_bppm_fc == nullptr) {
-		my_bppm_fc = make_fold_compound(true);
-		vrna_pf(my_bppm_fc, NULL);
+		my_bppm_fc = acquire_fold_compound(true);
+		my_g_tot = partition_function(my_bppm_fc);
+		my_g_tot_cached = true;
 	}
 
 	auto indices = normalize_range(my_seq, a, b, IndexEnum::ITEM);
@@ -52,41 +283,131 @@ ViennaRnaFold::base_pair_prob(int a, int b) const {
 	
 double
 ViennaRnaFold::macrostate_prob(string constraint) const {
-	vrna_fold_compound_t *fc = make_fold_compound(false);
-
-	// Calculate the free energy for the whole ensemble.
-	double g_tot = vrna_pf(fc, NULL);
+	return macrostate_prob(HardConstraint(constraint));
+}
 
-	// Add a constraint that defines the given macrostate.
-	vrna_constraints_add(fc, constraint.c_str(),
-			VRNA_CONSTRAINT_DB_DEFAULT | VRNA_CONSTRAINT_DB_ENFORCE_BP);
+double
+ViennaRnaFold::macrostate_prob(HardConstraint const &constraint) const {
+	// Get the free energy for the whole ensemble.  This doesn't depend on the 
+	// macrostate, so it's only calculated the first time it's needed.
+	double g_tot = ensemble_free_energy();
 
 	// Calculate the free energy for the given macrostate.
-	double g_active = vrna_pf(fc, NULL);
+	double kT;
+	double g_active = free_energy(&constraint, kT);
 
 	// Return the probability that the device will be in the given macrostate 
 	// at equilibrium.
-	double kT = fc->exp_params->kT / 1000;
 	return exp((g_tot - g_active) / kT);
 }
 
+double
+ViennaRnaFold::free_energy(HardConstraint const *constraint, double &kT) const {
+	vrna_fold_compound_t *fc = acquire_fold_compound(false);
+
+	if(constraint) {
+		add_constraint(fc, *constraint);
+	}
+
+	double g = partition_function(fc);
+	kT = fc->exp_params->kT / 1000;
+
+	release_fold_compound(fc);
+	return g;
+}
+
+double
+ViennaRnaFold::macrostate_mfe_prob(HardConstraint const &constraint) const {
+	// The unconstrained MFE doesn't depend on the macrostate, so it's only 
+	// calculated the first time it's needed.
+	double kT;
+	if(not my_g_mfe_cached) {
+		my_g_mfe = min_free_energy(nullptr, kT);
+		my_g_mfe_cached = true;
+	}
+
+	double g_macrostate = min_free_energy(&constraint, kT);
+	return 1 / (1 + exp((g_macrostate - my_g_mfe) / kT));
+}
+
+double
+ViennaRnaFold::min_free_energy(HardConstraint const *constraint, double &kT) const {
+	vrna_fold_compound_t *fc = acquire_fold_compound(false);
+
+	if(constraint) {
+		add_constraint(fc, *constraint);
+	}
+
+	our_mfe_calls++;
+	double g = vrna_mfe(fc, NULL);
+	kT = fc->exp_params->kT / 1000;
+
+	release_fold_compound(fc);
+	return g;
+}
+
+RnaFoldCounters
+ViennaRnaFold::counters() {
+	RnaFoldCounters counters;
+	counters.pf_calls = our_pf_calls;
+	counters.pf_calls_saved = our_pf_calls_saved;
+	counters.pf_calls_skipped = our_pf_calls_skipped;
+	counters.mfe_calls = our_mfe_calls;
+	counters.peak_bytes = our_peak_bytes;
+	return counters;
+}
+
+void
+ViennaRnaFold::reset_counters() {
+	our_pf_calls = 0;
+	our_pf_calls_saved = 0;
+	our_pf_calls_skipped = 0;
+	our_mfe_calls = 0;
+	our_peak_bytes = 0;
+}
+
+double
+ViennaRnaFold::ensemble_free_energy() const {
+	if(my_g_tot_cached) {
+		our_pf_calls_saved++;
+	}
+	else {
+		double kT;
+		my_g_tot = free_energy(nullptr, kT);
+		my_g_tot_cached = true;
+	}
+	return my_g_tot;
+}
+
+double
+ViennaRnaFold::partition_function(vrna_fold_compound_t *fc) const {
+	our_pf_calls++;
+	my_pf_calls++;
+	return vrna_pf(fc, NULL);
+}
+
+int
+ViennaRnaFold::num_pf_calls() const {
+	return my_pf_calls;
+}
+
+void
+ViennaRnaFold::count_skipped_pf_calls(long num_skipped) {
+	our_pf_calls_skipped += num_skipped;
+}
+
 vrna_fold_compound_t *
-ViennaRnaFold::make_fold_compound(bool compute_bppm) const {
+ViennaRnaFold::acquire_fold_compound(bool compute_bppm) const {
 	// Make sure the device hasn't changed since this engine was created.
 	assert(my_device->len() == my_seq.length());
 
-	// Tell ViennaRNA not to calculate the base-pair probability matrix (BPPM) if 
-	// we won't be using it.
-	vrna_md_t md;
-	vrna_md_set_default(&md);
-  md.backtrack = compute_bppm;
-	md.compute_bpp = compute_bppm;
-
-	// Create a new "fold compound" data structure and store a pointer to it so 
-	// it can be deallocated later.
+	// Get a fold compound from this thread's pool, and keep track of how much 
+	// memory this engine is holding onto.
 	vrna_fold_compound_t *fc =
-		vrna_fold_compound(my_seq.c_str(), &md, VRNA_OPTION_PF);
-	my_fcs.push_back(fc);
+		FoldCompoundPool::local().acquire(my_seq, compute_bppm);
+	long const bytes = FoldCompoundPool::dp_bytes(fc);
+	atomic_max(our_peak_bytes, my_bytes += bytes);
+	if(my_memory) my_memory->acquire(bytes);
 
 	// Add the aptamer, if we were given one.
 	if (my_aptamer) {
@@ -102,8 +423,200 @@ ViennaRnaFold::make_fold_compound(bool compute_bppm) const {
 	return fc;
 }
 
+void
+ViennaRnaFold::release_fold_compound(vrna_fold_compound_t *fc) const {
+	long const bytes = FoldCompoundPool::dp_bytes(fc);
+	my_bytes -= bytes;
+	if(my_memory) my_memory->release(bytes);
+	FoldCompoundPool::local().release(fc);
+}
+
+void
+ViennaRnaFold::add_constraint(
+		vrna_fold_compound_t *fc,
+		HardConstraint const &constraint) {
+
+	// Compiled constraints are added one base pair (or unpaired position) at a 
+	// time, in the same order and with the same options that ViennaRNA would 
+	// use if it parsed the dot-bracket string itself.
+	if(constraint.is_compiled()) {
+		for(auto const &op: constraint.operations()) {
+			if(op.j > 0) {
+				vrna_hc_add_bp(fc, op.i, op.j,
+						VRNA_CONSTRAINT_CONTEXT_ALL_LOOPS | VRNA_CONSTRAINT_CONTEXT_ENFORCE);
+			}
+			else {
+				vrna_hc_add_up(fc, op.i, VRNA_CONSTRAINT_CONTEXT_ALL_LOOPS);
+			}
+		}
+	}
+	else {
+		vrna_constraints_add(fc, constraint.dot_bracket().c_str(),
+				VRNA_CONSTRAINT_DB_DEFAULT | VRNA_CONSTRAINT_DB_ENFORCE_BP);
+	}
+}
+
+
+PrecomputedRnaFold::PrecomputedRnaFold(RnaFold const &fallback):
+	my_fallback(fallback),
+	my_g_tot(0),
+	my_kT(0),
+	my_g_tot_known(false) {}
+
+void
+PrecomputedRnaFold::add_free_energy(
+		HardConstraint const *constraint,
+		double free_energy,
+		double kT) {
+
+	if(constraint) {
+		my_free_energies.push_back({constraint, free_energy});
+	}
+	else {
+		my_g_tot = free_energy;
+		my_kT = kT;
+		my_g_tot_known = true;
+	}
+}
+
+double
+PrecomputedRnaFold::base_pair_prob(int a, int b) const {
+	return my_fallback.base_pair_prob(a, b);
+}
+
+double
+PrecomputedRnaFold::macrostate_prob(string constraint) const {
+	return my_fallback.macrostate_prob(constraint);
+}
+
+double
+PrecomputedRnaFold::macrostate_mfe_prob(HardConstraint const &constraint) const {
+	return my_fallback.macrostate_mfe_prob(constraint);
+}
+
+double
+PrecomputedRnaFold::macrostate_prob(HardConstraint const &constraint) const {
+	// Constraints are compared by identity, because they're shared between 
+	// every device with the same macrostates.  There are only ever a handful, 
+	// so a linear search is fine.
+	if(my_g_tot_known) {
+		for(auto const &item: my_free_energies) {
+			if(item.first == &constraint) {
+				return exp((my_g_tot - item.second) / my_kT);
+			}
+		}
+	}
+	return my_fallback.macrostate_prob(constraint);
+}
+
+
+FoldPlan::FoldPlan():
+	my_num_requests(0) {}
+
+int
+FoldPlan::request(
+		DeviceConstPtr device,
+		AptamerConstPtr aptamer,
+		HardConstraintConstPtr constraint,
+		string const &macrostate) {
+
+	my_num_requests++;
+
+	// Case doesn't affect folding, so don't let it keep jobs from being merged.
+	Key key(
+			boost::to_upper_copy(device->seq()),
+			aptamer.get(),
+			constraint.get());
+
+	auto it = my_job_ids.find(key);
+	if(it != my_job_ids.end()) {
+		return it->second;
+	}
+
+	Job job;
+	job.device = device;
+	job.aptamer = aptamer;
+	job.constraint = constraint;
+	job.macrostate = macrostate;
+
+	int id = my_jobs.size();
+	my_jobs.push_back(job);
+	my_job_ids[key] = id;
+	return id;
+}
+
+void
+FoldPlan::run(int num_threads, DpMemoryTracker *memory) {
+	vector<int> order = this->order();
+
+	// Each job only touches its own entry, and ViennaRnaFold::free_energy() 
+	// uses the calling thread's fold compound pool, so the jobs are independent.
+	parallel_for(order.size(), num_threads, [&](int k) {
+			Job &job = my_jobs[order[k]];
+			auto start = std::chrono::steady_clock::now();
 
-ScoreFunction::ScoreFunction() {}
+			ViennaRnaFold fold(job.device, job.aptamer, memory);
+			job.free_energy = fold.free_energy(job.constraint.get(), job.kT);
+
+			std::chrono::duration<double> elapsed =
+				std::chrono::steady_clock::now() - start;
+			job.seconds = elapsed.count();
+	});
+}
+
+vector<FoldPlan::Job> const &
+FoldPlan::jobs() const {
+	return my_jobs;
+}
+
+vector<int>
+FoldPlan::order() const {
+	// The cost of folding grows with the cube of the sequence length, so 
+	// starting the longest jobs first keeps the last thread from finishing long 
+	// after the others.
+	vector<int> order(my_jobs.size());
+	std::iota(order.begin(), order.end(), 0);
+	std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+			return my_jobs[a].device->len() > my_jobs[b].device->len();
+	});
+	return order;
+}
+
+int
+FoldPlan::num_requests() const {
+	return my_num_requests;
+}
+
+
+int
+ScoreSchema::size() const {
+	return names.size();
+}
+
+double
+ScoreSchema::weighted_sum(vector<double> const &values) const {
+	double total = 0;
+	for(int c = 0; c < num_contexts; c++) {
+		double subtotal = 0;
+		for(int row = c * num_terms; row < (c + 1) * num_terms; row++) {
+			subtotal += weights[row] * values[row];
+		}
+		total += subtotal;
+	}
+	return total;
+}
+
+
+ScoreFunction::ScoreFunction():
+	my_num_threads(1),
+	my_terms_evaluated(0),
+	my_terms_skipped(0),
+	my_fold_requests(0),
+	my_fold_jobs(0),
+	my_peak_bytes_per_evaluation(0) {
+
+	compile_schema();
+}
 
 double
 ScoreFunction::evaluate(DeviceConstPtr device) const {
@@ -116,50 +629,468 @@ ScoreFunction::evaluate(
 		DeviceConstPtr device,
 		EvaluatedScoreFunction &table) const {
 
-	double score = 0;
+	return evaluate_batch({device}, &table)[0];
+}
 
-	table.clear();
+double
+ScoreFunction::evaluate_or_reject(
+		DeviceConstPtr device,
+		EvaluatedScoreFunction &table,
+		double threshold,
+		bool &rejected) const {
 
-	if(my_contexts.empty()) {
-		score += evaluate_terms(device, table);
+	double score;
+	string key;
+	rejected = false;
+
+	// Don't do any work if this device has already been scored.
+	if(my_cache) {
+		key = cache_key(device);
+		if(my_cache->lookup(key, score, table)) {
+			return score;
+		}
 	}
-	else {
-		DevicePtr scratch_device = device->copy();
-		for(auto context: my_contexts) {
-			scratch_device->context(context.second);
-			score += evaluate_terms(scratch_device, table, context.first + ": ");
+
+	// Start with every term unevaluated, and work out the highest score that 
+	// the device could possibly get.  Terms with negative weights don't have an 
+	// upper bound, because they don't have a lower bound.
+	ScoreSchema const &schema = *my_schema;
+	int const num_terms = schema.num_terms;
+	int num_unbounded = 0;
+	double best_remaining = 0;
+
+	auto best_contribution = [&](int row) {
+		double weight = schema.weights[row];
+		return (weight == 0)? 0 : weight * my_terms[schema.term_ids[row]]->max_value();
+	};
+	auto is_unbounded = [&](int row, double best) {
+		return schema.weights[row] < 0 or std::isinf(best);
+	};
+
+	table.schema = my_schema;
+	table.values.assign(schema.size(), std::numeric_limits<double>::quiet_NaN());
+
+	for(int row = 0; row < schema.size(); row++) {
+		double best = best_contribution(row);
+		if(is_unbounded(row, best)) num_unbounded++;
+		else best_remaining += best;
+	}
+
+	// Evaluate the shortest (i.e. cheapest to fold) contexts first, so that 
+	// hopeless devices are rejected as cheaply as possible.  The partition 
+	// functions for each context are calculated up front (on every thread), 
+	// and anything else is only calculated if a term asks for it.
+	double partial_score = 0;
+	int num_evaluated = 0;
+	long num_fold_jobs = 0;
+	DpMemoryTracker memory;
+
+	for(int c: my_contexts_by_length) {
+		DeviceConstPtr context_device = device;
+		if(my_schema_contexts[c]) {
+			DevicePtr scratch_device = device->copy();
+			scratch_device->context(my_schema_contexts[c]);
+			context_device = scratch_device;
+		}
+
+		FoldPlan plan;
+		vector<vector<pair<ConditionEnum,int>>> job_folds;
+		plan_folds({context_device}, plan, job_folds);
+		plan.run(my_num_threads, &memory);
+		record_fold_timings(plan);
+		num_fold_jobs += plan.jobs().size();
+
+		ViennaRnaFold apo_engine(context_device, nullptr, &memory);
+		ViennaRnaFold holo_engine(context_device, my_aptamer, &memory);
+		PrecomputedRnaFold apo_fold(apo_engine);
+		PrecomputedRnaFold holo_fold(holo_engine);
+
+		for(auto const &fold: job_folds[0]) {
+			FoldPlan::Job const &job = plan.jobs()[fold.second];
+			PrecomputedRnaFold &engine =
+				(fold.first == ConditionEnum::APO)? apo_fold : holo_fold;
+			engine.add_free_energy(job.constraint.get(), job.free_energy, job.kT);
 		}
+
+		for(int t = 0; t < num_terms; t++) {
+			int const row = c * num_terms + t;
+			table.values[row] = my_terms[t]->evaluate(context_device, apo_fold, holo_fold);
+			partial_score += schema.weights[row] * table.values[row];
+			my_terms_evaluated++;
+			num_evaluated++;
+
+			double best = best_contribution(row);
+			if(is_unbounded(row, best)) num_unbounded--;
+			else best_remaining -= best;
+
+			// Give up if the device can't possibly reach the threshold (unless 
+			// there's nothing left to skip).
+			double upper_bound = partial_score + best_remaining;
+			if(num_unbounded == 0 and upper_bound < threshold and
+					num_evaluated < schema.size()) {
+				my_terms_skipped += schema.size() - num_evaluated;
+				ViennaRnaFold::count_skipped_pf_calls(
+						std::max(my_fold_jobs_per_device - num_fold_jobs, 0L));
+
+				atomic_max(my_peak_bytes_per_evaluation, memory.peak_bytes());
+				rejected = true;
+				return upper_bound;
+			}
+		}
+	}
+
+	atomic_max(my_peak_bytes_per_evaluation, memory.peak_bytes());
+
+	// Add up the score in the same order as evaluate(), so the result is 
+	// exactly the same (including rounding).
+	score = schema.weighted_sum(table.values);
+
+	if(my_cache) {
+		my_cache->store(key, score, table);
 	}
 
 	return score;
 }
 
+vector<double>
+ScoreFunction::evaluate_many(vector<DeviceConstPtr> const &devices) const {
+	vector<EvaluatedScoreFunction> tables;
+	return evaluate_many(devices, tables);
+}
+
+vector<double>
+ScoreFunction::evaluate_many(
+		vector<DeviceConstPtr> const &devices,
+		vector<EvaluatedScoreFunction> &tables) const {
+
+	tables.resize(devices.size());
+	return evaluate_batch(devices, tables.data());
+}
+
+vector<double>
+ScoreFunction::evaluate_batch(
+		vector<DeviceConstPtr> const &devices,
+		EvaluatedScoreFunction *tables) const {
+
+	int const num_devices = devices.size();
+	vector<double> scores(num_devices, 0);
+	vector<string> keys(num_devices);
+	vector<int> unscored;
+
+	// Don't do any work for devices that have already been scored.
+	for(int i = 0; i < num_devices; i++) {
+		if(my_cache) {
+			keys[i] = cache_key(devices[i]);
+			if(my_cache->lookup(keys[i], scores[i], tables[i])) {
+				continue;
+			}
+		}
+		unscored.push_back(i);
+	}
+
+	// Lay out the score tables.  The values are filled in below, and each 
+	// table keeps its storage from one evaluation to the next.
+	for(int i: unscored) {
+		tables[i].schema = my_schema;
+		tables[i].values.resize(my_schema->size());
+	}
+
+	// Make a job for every combination of device and context.  If there aren't 
+	// any contexts, each device is scored by itself.
+	vector<DeviceConstPtr> unscored_devices;
+	for(int i: unscored) {
+		unscored_devices.push_back(devices[i]);
+	}
+
+	int const num_contexts = my_schema->num_contexts;
+	vector<DeviceConstPtr> job_devices = contextualize(unscored_devices);
+	int const num_jobs = job_devices.size();
+	vector<double> job_scores(num_jobs);
+
+	// Calculate the partition functions that the terms will need up front.  
+	// Duplicates are merged, and the remaining folds are spread across every 
+	// thread, even if there's only one device and one context.
+	FoldPlan plan;
+	vector<vector<pair<ConditionEnum,int>>> job_folds;
+	plan_folds(job_devices, plan, job_folds);
+
+	DpMemoryTracker memory;
+	plan.run(my_num_threads, &memory);
+	record_fold_timings(plan);
+
+	// The jobs are independent, so run them in parallel.  Each thread fills in 
+	// its own score and its own rows of the table, and the results are combined 
+	// in the same order as the contexts afterward, so the total score 
+	// (including any rounding) doesn't depend on the number of threads.
+	parallel_for(num_jobs, my_num_threads, [&](int job) {
+			int const i = unscored[job / num_contexts];
+			int const c = job % num_contexts;
+			int const first_row = c * my_schema->num_terms;
+
+			job_scores[job] = evaluate_terms(
+					job_devices[job], tables[i], first_row, plan, job_folds[job],
+					&memory);
+	});
+
+	atomic_max(my_peak_bytes_per_evaluation, memory.peak_bytes());
+
+	for(int u = 0; u < int(unscored.size()); u++) {
+		int i = unscored[u];
+
+		for(int job = u * num_contexts; job < (u + 1) * num_contexts; job++) {
+			scores[i] += job_scores[job];
+		}
+
+		if(my_cache) {
+			my_cache->store(keys[i], scores[i], tables[i]);
+		}
+	}
+
+	return scores;
+}
+
 double
 ScoreFunction::evaluate_terms(
 		DeviceConstPtr device,
 		EvaluatedScoreFunction &table,
-		string term_prefix) const {
+		int first_row,
+		FoldPlan const &plan,
+		vector<pair<ConditionEnum,int>> const &folds,
+		DpMemoryTracker *memory) const {
 
 	double score = 0;
 
-	ViennaRnaFold apo_fold(device);
-	ViennaRnaFold holo_fold(device, my_aptamer);
+	// Anything that wasn't planned (e.g. base-pair probabilities, or terms that 
+	// don't declare what they need) is calculated when it's asked for.
+	ViennaRnaFold apo_engine(device, nullptr, memory);
+	ViennaRnaFold holo_engine(device, my_aptamer, memory);
+	PrecomputedRnaFold apo_fold(apo_engine);
+	PrecomputedRnaFold holo_fold(holo_engine);
+
+	for(auto const &fold: folds) {
+		FoldPlan::Job const &job = plan.jobs()[fold.second];
+		PrecomputedRnaFold &engine =
+			(fold.first == ConditionEnum::APO)? apo_fold : holo_fold;
+		engine.add_free_energy(job.constraint.get(), job.free_energy, job.kT);
+	}
 
-	for(ScoreTermPtr term: my_terms) {
-		EvaluatedScoreTerm eval;
-		eval.name = term_prefix + term->name();
-		eval.weight = term->weight();
-		eval.term = term->evaluate(device, apo_fold, holo_fold);
-		table.push_back(eval);
-		score += eval.weight * eval.term;
+	for(int t = 0; t < int(my_terms.size()); t++) {
+		int const row = first_row + t;
+		table.values[row] = my_terms[t]->evaluate(device, apo_fold, holo_fold);
+		my_terms_evaluated++;
+		score += my_schema->weights[row] * table.values[row];
 	}
 
 	return score;
 }
 
+vector<DeviceConstPtr>
+ScoreFunction::contextualize(vector<DeviceConstPtr> const &devices) const {
+	vector<DeviceConstPtr> context_devices;
+	context_devices.reserve(devices.size() * my_schema_contexts.size());
+
+	for(auto device: devices) {
+		for(auto context: my_schema_contexts) {
+			if(context) {
+				DevicePtr scratch_device = device->copy();
+				scratch_device->context(context);
+				context_devices.push_back(scratch_device);
+			}
+			else {
+				context_devices.push_back(device);
+			}
+		}
+	}
+
+	return context_devices;
+}
+
+FoldPlan
+ScoreFunction::plan(vector<DeviceConstPtr> const &devices) const {
+	FoldPlan plan;
+	vector<vector<pair<ConditionEnum,int>>> job_folds;
+	plan_folds(contextualize(devices), plan, job_folds);
+	return plan;
+}
+
+void
+ScoreFunction::plan_folds(
+		vector<DeviceConstPtr> const &devices,
+		FoldPlan &plan,
+		vector<vector<pair<ConditionEnum,int>>> &job_folds) const {
+
+	int const num_requests = plan.num_requests();
+	int const num_jobs = plan.jobs().size();
+	job_folds.assign(devices.size(), {});
+
+	// Only the partition functions that some term asks for are planned, so 
+	// nothing is folded in the holo condition unless a term needs it.  Every 
+	// macrostate probability also needs the free energy of the whole ensemble 
+	// in the same condition.
+	for(int d = 0; d < int(devices.size()); d++) {
+		for(auto const &requests: my_term_fold_requests) {
+			for(auto const &request: requests) {
+				AptamerConstPtr aptamer = 
+					(request.condition == ConditionEnum::HOLO)? my_aptamer : nullptr;
+				HardConstraintConstPtr constraint =
+					devices[d]->macrostate_constraint(request.macrostate);
+
+				job_folds[d].push_back({request.condition,
+						plan.request(devices[d], aptamer, nullptr)});
+				job_folds[d].push_back({request.condition,
+						plan.request(devices[d], aptamer, constraint, request.macrostate)});
+			}
+		}
+	}
+
+	my_fold_requests += plan.num_requests() - num_requests;
+	my_fold_jobs += plan.jobs().size() - num_jobs;
+}
+
+void
+ScoreFunction::record_fold_timings(FoldPlan const &plan) const {
+	std::lock_guard<std::mutex> lock(my_fold_timings_mutex);
+
+	for(auto const &job: plan.jobs()) {
+		ConditionEnum condition = job.aptamer? ConditionEnum::HOLO : ConditionEnum::APO;
+		FoldTimings &timings = my_fold_timings[{condition, job.macrostate}];
+		timings.jobs++;
+		timings.seconds += job.seconds;
+	}
+}
+
+void
+ScoreFunction::compile_schema() {
+	auto schema = make_shared<ScoreSchema>();
+
+	// If there aren't any contexts, the device is scored by itself.
+	my_schema_contexts.clear();
+	schema->context_names.clear();
+
+	for(auto const &context: my_contexts) {
+		schema->context_names.push_back(context.first);
+		my_schema_contexts.push_back(context.second);
+	}
+	if(my_contexts.empty()) {
+		schema->context_names.push_back("");
+		my_schema_contexts.push_back(nullptr);
+	}
+
+	schema->num_terms = my_terms.size();
+	schema->num_contexts = my_schema_contexts.size();
+
+	for(int c = 0; c < schema->num_contexts; c++) {
+		string prefix = my_schema_contexts[c]? schema->context_names[c] + ": " : "";
+		for(int t = 0; t < schema->num_terms; t++) {
+			schema->names.push_back(prefix + my_terms[t]->name());
+			schema->weights.push_back(my_terms[t]->weight());
+			schema->term_ids.push_back(t);
+			schema->context_ids.push_back(c);
+		}
+	}
+
+	// Work out which contexts are shortest (i.e. cheapest to fold), for 
+	// evaluate_or_reject().
+	auto context_len = [&](int c) {
+		ContextConstPtr context = my_schema_contexts[c];
+		return context? context->before().length() + context->after().length() : 0;
+	};
+
+	// Find out which partition functions each term will need, so they can be 
+	// planned ahead of time.
+	my_term_fold_requests.clear();
+	for(auto term: my_terms) {
+		my_term_fold_requests.push_back(term->fold_requests());
+	}
+
+	// Count the partition functions planned for each device, so that 
+	// evaluate_or_reject() can tell how many it skipped.  Constraints are 
+	// shared by macrostate, so each condition needs one job for the whole 
+	// ensemble and one for each macrostate, in every context.
+	std::set<pair<ConditionEnum,string>> folds_per_context;
+	for(auto const &requests: my_term_fold_requests) {
+		for(auto const &request: requests) {
+			folds_per_context.insert({request.condition, ""});
+			folds_per_context.insert({request.condition, request.macrostate});
+		}
+	}
+	my_fold_jobs_per_device = folds_per_context.size() * schema->num_contexts;
+
+	my_contexts_by_length.resize(schema->num_contexts);
+	std::iota(my_contexts_by_length.begin(), my_contexts_by_length.end(), 0);
+	std::stable_sort(
+			my_contexts_by_length.begin(), my_contexts_by_length.end(),
+			[&](int a, int b) { return context_len(a) < context_len(b); });
+
+	my_schema = schema;
+}
+
+string
+ScoreFunction::cache_key(DeviceConstPtr device) const {
+	string key;
+
+	// Include everything about the score function that affects the score, so 
+	// that a single cache can be shared by different score functions.
+	if(my_aptamer) {
+		key += (f("%s %s %.17g\n")
+				% my_aptamer->seq()
+				% my_aptamer->fold()
+				% my_aptamer->affinity()).str();
+	}
+	for(auto context: my_contexts) {
+		key += (f("%s: %s %s\n")
+				% context.first
+				% context.second->before()
+				% context.second->after()).str();
+	}
+	for(auto term: my_terms) {
+		key += (f("%s %.17g\n") % term->name() % term->weight()).str();
+	}
+
+	// Include the macrostates, which are kept in order of name.
+	for(auto const &macrostate: *device->macrostate_table()) {
+		key += macrostate.first + ": " + macrostate.second + "\n";
+	}
+
+	// Include the device's own context, which is what it's folded in if the 
+	// score function doesn't have any contexts.
+	key += (f("%s %s\n")
+			% device->context()->before()
+			% device->context()->after()).str();
+
+	// Include the sequence itself, independent of any context.
+	key += device->raw_seq();
+	return key;
+}
+
+ScoreSchemaConstPtr
+ScoreFunction::schema() const {
+	return my_schema;
+}
+
+ScoreFunctionPtr
+ScoreFunction::surrogate() const {
+	ScoreFunctionPtr surrogate = make_shared<ScoreFunction>();
+	surrogate->aptamer(my_aptamer);
+	surrogate->num_threads(my_num_threads);
+
+	for(auto const &context: my_contexts) {
+		surrogate->add_context(context.first, context.second);
+	}
+	for(auto term: my_terms) {
+		if(ScoreTermPtr cheap_term = term->surrogate()) {
+			cheap_term->weight(term->weight());
+			surrogate->add_term(cheap_term);
+		}
+	}
+
+	return surrogate;
+}
+
 void 
 ScoreFunction::add_term(ScoreTermPtr term) {
 	my_terms.push_back(term);
+	compile_schema();
 }
 
 void 
@@ -185,12 +1116,151 @@ ScoreFunction::context(string name) const {
 void 
 ScoreFunction::add_context(string name, ContextConstPtr context) {
 	my_contexts[name] = context;
+	compile_schema();
+}
+
+ScoreCachePtr
+ScoreFunction::cache() const {
+	return my_cache;
+}
+
+void
+ScoreFunction::cache(ScoreCachePtr cache) {
+	my_cache = cache;
+}
+
+ScoreFunctionCounters
+ScoreFunction::counters() const {
+	ScoreFunctionCounters counters;
+	counters.terms_evaluated = my_terms_evaluated;
+	counters.terms_skipped = my_terms_skipped;
+	counters.fold_requests = my_fold_requests;
+	counters.fold_jobs = my_fold_jobs;
+	counters.peak_bytes_per_evaluation = my_peak_bytes_per_evaluation;
+
+	std::lock_guard<std::mutex> lock(my_fold_timings_mutex);
+	counters.fold_timings = my_fold_timings;
+	return counters;
+}
+
+int
+ScoreFunction::num_threads() const {
+	return my_num_threads;
+}
+
+void
+ScoreFunction::num_threads(int num_threads) {
+	if(num_threads < 1) {
+		throw (f("can't evaluate score function with %d threads") % num_threads).str();
+	}
+	my_num_threads = num_threads;
+}
+
+
+ScoreCache::ScoreCache(unsigned capacity, EvictionEnum eviction):
+	my_capacity(capacity), my_eviction(eviction) {}
+
+bool
+ScoreCache::lookup(
+		string const &key,
+		double &score,
+		EvaluatedScoreFunction &table) {
+
+	std::lock_guard<std::mutex> lock(my_mutex);
+
+	auto &by_key = my_entries.get<1>();
+	auto it = by_key.find(key);
+
+	if(it == by_key.end()) {
+		my_counters.misses++;
+		return false;
+	}
+
+	// With the LRU policy, move the entry to the front of the queue so it will 
+	// be the last to be evicted.  With the FIFO policy, the entry stays where 
+	// it was inserted.
+	if(my_eviction == EvictionEnum::LRU) {
+		my_entries.relocate(my_entries.begin(), my_entries.project<0>(it));
+	}
+
+	// Copy the values into the existing table, so that its storage is reused.
+	my_counters.hits++;
+	score = it->score;
+	table.schema = it->table.schema;
+	table.values.assign(it->table.values.begin(), it->table.values.end());
+	return true;
+}
+
+void
+ScoreCache::store(
+		string const &key,
+		double score,
+		EvaluatedScoreFunction const &table) {
+
+	std::lock_guard<std::mutex> lock(my_mutex);
+
+	if(my_capacity == 0) {
+		return;
+	}
+
+	// Another thread may have scored the same device in the meantime.
+	if(not my_entries.push_front({key, score, table}).second) {
+		return;
+	}
+
+	while(my_entries.size() > my_capacity) {
+		my_entries.pop_back();
+		my_counters.evictions++;
+	}
+}
+
+void
+ScoreCache::clear() {
+	std::lock_guard<std::mutex> lock(my_mutex);
+	my_entries.clear();
+}
+
+unsigned
+ScoreCache::size() const {
+	std::lock_guard<std::mutex> lock(my_mutex);
+	return my_entries.size();
+}
+
+unsigned
+ScoreCache::capacity() const {
+	return my_capacity;
+}
+
+EvictionEnum
+ScoreCache::eviction() const {
+	return my_eviction;
+}
+
+ScoreCacheCounters
+ScoreCache::counters() const {
+	std::lock_guard<std::mutex> lock(my_mutex);
+	return my_counters;
 }
 
 
 ScoreTerm::ScoreTerm(string name, double weight):
 	my_name(name), my_weight(weight) {}
 
+double
+ScoreTerm::max_value() const {
+	return std::numeric_limits<double>::infinity();
+}
+
+FoldRequestList
+ScoreTerm::fold_requests() const {
+	return {};
+}
+
+ScoreTermPtr
+ScoreTerm::surrogate() const {
+	return nullptr;
+}
+
 string
 ScoreTerm::name() const {
 	return my_name;
@@ -236,16 +1306,12 @@ MacrostateProbTerm::evaluate(
 		RnaFold const &apo_fold,
 		RnaFold const &holo_fold) const {
 
-	// Get a pointer to the right folding engine.
-	RnaFold const *apropos_fold;
-	switch(my_condition) {
-		case ConditionEnum::APO: apropos_fold = &apo_fold; break;
-		case ConditionEnum::HOLO: apropos_fold = &holo_fold; break;
-	}
+	// Get the right folding engine.
+	RnaFold const &apropos_fold = fold_for(my_condition, apo_fold, holo_fold);
 
 	// Calculate the probability of adopting this fold in this condition.
-	string constraint = device->macrostate(my_macrostate);
-	double macrostate_prob = apropos_fold->macrostate_prob(constraint);
+	HardConstraintConstPtr constraint = device->macrostate_constraint(my_macrostate);
+	double macrostate_prob = apropos_fold.macrostate_prob(*constraint);
 
 	// Invert the probability if we want to avoid this fold in this condition.
 	switch(my_favorable) {
@@ -258,6 +1324,147 @@ MacrostateProbTerm::evaluate(
 	return log(macrostate_prob);
 }
 
+double
+MacrostateProbTerm::max_value() const {
+	return 0;
+}
+
+FoldRequestList
+MacrostateProbTerm::fold_requests() const {
+	return {{my_condition, my_macrostate}};
+}
+
+ScoreTermPtr
+MacrostateProbTerm::surrogate() const {
+	return make_shared<MfeMacrostateProbTerm>(
+			my_macrostate, my_condition, my_favorable);
+}
+
+
+MfeMacrostateProbTerm::MfeMacrostateProbTerm(
+		string macrostate,
+		ConditionEnum condition,
+		FavorableEnum favorable):
+
+	ScoreTerm("mfe_macrostate"),
+	my_macrostate(macrostate),
+	my_condition(condition),
+	my_favorable(favorable) {
+
+	string desc;
+	desc += (my_condition == ConditionEnum::APO)? "apo" : "holo";
+	desc += ": mfe ";
+	desc += (my_favorable == FavorableEnum::NO)? "not " : "";
+	desc += macrostate;
+	name(desc);
+}
+
+double
+MfeMacrostateProbTerm::evaluate(
+		DeviceConstPtr device,
+		RnaFold const &apo_fold,
+		RnaFold const &holo_fold) const {
+
+	// Get the right folding engine.
+	RnaFold const &apropos_fold = fold_for(my_condition, apo_fold, holo_fold);
+
+	// Estimate the probability of adopting this fold in this condition, and 
+	// invert it if we want to avoid this fold.
+	HardConstraintConstPtr constraint = device->macrostate_constraint(my_macrostate);
+	double macrostate_prob = apropos_fold.macrostate_mfe_prob(*constraint);
+
+	switch(my_favorable) {
+		case FavorableEnum::YES: break;
+		case FavorableEnum::NO: macrostate_prob = 1 - macrostate_prob; break;
+	}
+
+	return log(macrostate_prob);
+}
+
+double
+MfeMacrostateProbTerm::max_value() const {
+	return 0;
+}
+
+
+EnsembleDefectTerm::EnsembleDefectTerm(
+		string macrostate,
+		ConditionEnum condition,
+		FavorableEnum favorable):
+
+	ScoreTerm("ensemble_defect"),
+	my_macrostate(macrostate),
+	my_condition(condition),
+	my_favorable(favorable) {
+
+	string desc;
+	desc += (my_condition == ConditionEnum::APO)? "apo" : "holo";
+	desc += ": defect ";
+	desc += (my_favorable == FavorableEnum::NO)? "not " : "";
+	desc += macrostate;
+	name(desc);
+}
+
+double
+EnsembleDefectTerm::evaluate(
+		DeviceConstPtr device,
+		RnaFold const &apo_fold,
+		RnaFold const &holo_fold) const {
+
+	// Get the right folding engine.
+	RnaFold const &apropos_fold = fold_for(my_condition, apo_fold, holo_fold);
+
+	HardConstraintConstPtr constraint = device->macrostate_constraint(my_macrostate);
+	if(not constraint->is_compiled()) {
+		throw (f("can't calculate the ensemble defect of macrostate '%s': %s")
+				% my_macrostate % constraint->dot_bracket()).str();
+	}
+
+	// Add up the expected number of constrained positions in the right state.  
+	// The constraint uses 1-indexed positions, but the folding engine doesn't.  
+	// Both ends of a base pair are satisfied if the pair forms.  An unpaired 
+	// position is satisfied unless it pairs with anything.
+	int const len = device->len();
+	int num_positions = 0;
+	double num_satisfied = 0;
+
+	for(auto const &op: constraint->operations()) {
+		int const i = op.i - 1;
+
+		if(op.j > 0) {
+			num_satisfied += 2 * apropos_fold.base_pair_prob(i, op.j - 1);
+			num_positions += 2;
+		}
+		else {
+			double paired = 0;
+			for(int j = 0; j < len; j++) {
+				if(j != i) paired += apropos_fold.base_pair_prob(i, j);
+			}
+			num_satisfied += 1 - paired;
+			num_positions += 1;
+		}
+	}
+
+	if(num_positions == 0) {
+		return 0;
+	}
+
+	// Penalize the positions that aren't satisfied if we want this fold, or the 
+	// ones that are if we don't.
+	double defect = 1 - num_satisfied / num_positions;
+	switch(my_favorable) {
+		case FavorableEnum::YES: break;
+		case FavorableEnum::NO: defect = 1 - defect; break;
+	}
+
+	return -defect;
+}
+
+double
+EnsembleDefectTerm::max_value() const {
+	return 0;
+}
+
 
 }
 
@@ -281,5 +1488,14 @@ operator<<(ostream& out, const addapt::FavorableEnum& condition) {
 	return out;
 }
 
+ostream &
+operator<<(ostream& out, const addapt::EvictionEnum& eviction) {
+	switch(eviction) {
+		case addapt::EvictionEnum::LRU: out << "LRU"; break;
+		case addapt::EvictionEnum::FIFO: out << "FIFO"; break;
+	}
+	return out;
+}
+
 }
 
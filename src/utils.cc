@@ -3,9 +3,19 @@
 namespace addapt {
 
 int
-normalize_index(string sequence, int index, IndexEnum meaning) {
+normalize_index(string const &sequence, int index, IndexEnum meaning) {
+	// Only look at the sequence itself if an error message is needed.
+	try {
+		return normalize_index(int(sequence.length()), index, meaning);
+	}
+	catch(string) {
+		throw (f("no index '%d' in '%s'") % index % sequence).str();
+	}
+}
+
+int
+normalize_index(int seq_len, int index, IndexEnum meaning) {
 	int normalized_index = index;
-	int const seq_len = sequence.length();
 
 	// If the user gave a negative index, interpret it as counting backward from 
 	// the end of the sequence.
@@ -18,7 +28,7 @@ normalize_index(string sequence, int index, IndexEnum meaning) {
 	// positions between the nucleotides rather than the nucleotides themselves.  
 	int const max_index = seq_len - (meaning == IndexEnum::ITEM);
 	if(normalized_index < 0 or normalized_index > max_index) {
-		throw (f("no index '%d' in '%s'") % index % sequence).str();
+		throw (f("no index '%d' in sequence of length %d") % index % seq_len).str();
 	}
 
 	// Return the normalized index.
@@ -26,17 +36,23 @@ normalize_index(string sequence, int index, IndexEnum meaning) {
 }
 
 pair<int,int>
-normalize_range(string sequence, int start, int end, IndexEnum between) {
+normalize_range(string const &sequence, int start, int end, IndexEnum between) {
 	// Resolve negative and out-of-bounds indices.
 	start = normalize_index(sequence, start, between);
 	end = normalize_index(sequence, end, between);
 
 	// Work out which index is lower and which is higher.
-	int normalized_start = std::min(start, end);
-	int normalized_end = std::max(start, end);
+	return {std::min(start, end), std::max(start, end)};
+}
+
+pair<int,int>
+normalize_range(int seq_len, int start, int end, IndexEnum between) {
+	// Resolve negative and out-of-bounds indices.
+	start = normalize_index(seq_len, start, between);
+	end = normalize_index(seq_len, end, between);
 
-	// Return the normalized indices.
-	return {normalized_start, normalized_end};
+	// Work out which index is lower and which is higher.
+	return {std::min(start, end), std::max(start, end)};
 }
 
 string
@@ -111,6 +111,195 @@ TEST_CASE("Test the Device::mutate method", "[model]") {
 	}
 }
 
+TEST_CASE("Test that Device::seq() stays up to date", "[model]") {
+	Device dummy("ACGU");
+
+	dummy.mutate(0, 'U');
+	CHECK(dummy.seq() == "UCGU");
+
+	dummy.context(make_shared<Context>("GG", "C"));
+	CHECK(dummy.seq() == "GGUCGUC");
+	CHECK(dummy.raw_seq() == "UCGU");
+
+	dummy.mutate(-1, 'A');
+	CHECK(dummy.seq() == "GGUCGAC");
+	CHECK(dummy.seq(-2) == 'A');
+
+	dummy.undo_mutations();
+	CHECK(dummy.seq() == "GGACGUC");
+
+	dummy.remove_context();
+	CHECK(dummy.seq() == "ACGU");
+}
+
+TEST_CASE("Test undoing and replaying mutations", "[model]") {
+	Device dummy("AAAA");
+	Device other("AAAA");
+
+	CHECK(dummy.mutations().empty());
+
+	// Mutations that don't change the sequence aren't recorded.
+	dummy.mutate(0, 'A');
+	CHECK(dummy.mutations().empty());
+
+	dummy.mutate(1, 'C');
+	dummy.mutate(-1, 'G');
+	dummy.mutate(1, 'U');
+	CHECK(dummy.seq() == "AUAG");
+
+	MutationLog const &log = dummy.mutations();
+	REQUIRE(log.size() == 3);
+	CHECK(log[0].index == 1);
+	CHECK(log[0].before == 'A');
+	CHECK(log[0].after == 'C');
+	CHECK(log[1].index == 3);
+	CHECK(log[2].before == 'C');
+	CHECK(log[2].after == 'U');
+
+	SECTION("replaying mutations gives the same sequence") {
+		other.replay_mutations(dummy.mutations());
+		CHECK(other.seq() == "AUAG");
+		CHECK(other.mutations().empty());
+	}
+
+	SECTION("undoing mutations restores the original sequence") {
+		dummy.undo_mutations();
+		CHECK(dummy.seq() == "AAAA");
+		CHECK(dummy.mutations().empty());
+	}
+
+	SECTION("forgetting mutations keeps the sequence") {
+		dummy.forget_mutations();
+		CHECK(dummy.seq() == "AUAG");
+		CHECK(dummy.mutations().empty());
+
+		dummy.undo_mutations();
+		CHECK(dummy.seq() == "AUAG");
+	}
+}
+
+TEST_CASE("Test packing long and unusual sequences", "[model]") {
+	// Use enough nucleotides to span several words, and mix in some positions 
+	// that can't be packed into two bits.
+	string seq;
+	for(int i = 0; i < 100; i++) {
+		seq += "ACGUacguNn-T"[i % 12];
+	}
+
+	Device dummy(seq);
+	CHECK(dummy.seq() == seq);
+	CHECK(dummy.raw_len() == 100);
+
+	for(int i = 0; i < 100; i++) {
+		CHECK(dummy.raw_seq(i) == seq[i]);
+	}
+
+	// Exceptions can be replaced by normal nucleotides, and vice versa.
+	dummy.mutate(8, 'G');
+	dummy.mutate(0, 'N');
+	dummy.mutate(99, 'a');
+	seq[8] = 'G'; seq[0] = 'N'; seq[99] = 'a';
+	CHECK(dummy.seq() == seq);
+
+	dummy.undo_mutations();
+	CHECK(dummy.raw_seq(8) == 'N');
+	CHECK(dummy.raw_seq(0) == 'A');
+	CHECK(dummy.raw_seq(99) == 'U');
+}
+
+TEST_CASE("Test comparing and hashing devices", "[model]") {
+	Device dummy("ACGUn");
+	dummy.add_macrostate("a", "(..).");
+	dummy.add_macrostate("b", ".....");
+
+	DevicePtr copy = dummy.copy();
+	CHECK(*copy == dummy);
+	CHECK(copy->hash() == dummy.hash());
+	CHECK(copy->macrostate_table() == dummy.macrostate_table());
+
+	// Equivalent devices are equal, even if they don't share any tables.
+	Device other("ACGUn");
+	other.add_macrostate("b", ".....");
+	other.add_macrostate("a", "(..).");
+	CHECK(other == dummy);
+	CHECK(other.hash() == dummy.hash());
+	CHECK(std::hash<Device>()(other) == dummy.hash());
+
+	SECTION("different sequences") {
+		copy->mutate(0, 'C');
+		CHECK(*copy != dummy);
+		copy->undo_mutations();
+		CHECK(*copy == dummy);
+	}
+
+	SECTION("different mutability") {
+		copy->mutate(0, 'a');
+		CHECK(*copy != dummy);
+	}
+
+	SECTION("different macrostates") {
+		copy->add_macrostate("b", "(...)");
+		CHECK(*copy != dummy);
+		CHECK(copy->macrostate("b") == "(...)");
+		CHECK(dummy.macrostate("b") == ".....");
+	}
+
+	SECTION("different contexts") {
+		copy->context(make_shared<Context>("A", ""));
+		CHECK(*copy != dummy);
+		copy->remove_context();
+		CHECK(*copy == dummy);
+	}
+}
+
+TEST_CASE("Test compiling hard constraints", "[model]") {
+	HardConstraint simple("x(.)(x)");
+	CHECK(simple.is_compiled());
+	REQUIRE(simple.operations().size() == 4);
+	CHECK(simple.operations()[0].i == 1);
+	CHECK(simple.operations()[0].j == 0);
+	CHECK(simple.operations()[1].i == 2);
+	CHECK(simple.operations()[1].j == 4);
+	CHECK(simple.operations()[2].i == 6);
+	CHECK(simple.operations()[2].j == 0);
+	CHECK(simple.operations()[3].i == 5);
+	CHECK(simple.operations()[3].j == 7);
+
+	HardConstraint unusual("(.|)");
+	CHECK_FALSE(unusual.is_compiled());
+	CHECK(unusual.operations().empty());
+	CHECK(unusual.dot_bracket() == "(.|)");
+
+	CHECK_THROWS(HardConstraint("(."));
+	CHECK_THROWS(HardConstraint(".)"));
+}
+
+TEST_CASE("Test caching compiled macrostates", "[model]") {
+	Device dummy("ACGU");
+	dummy.add_macrostate("a", "(..)");
+	DevicePtr copy = dummy.copy();
+
+	HardConstraintConstPtr bare = dummy.macrostate_constraint("a");
+	CHECK(bare->dot_bracket() == "(..)");
+	CHECK(copy->macrostate_constraint("a") == bare);
+	CHECK_THROWS(dummy.macrostate_constraint("b"));
+
+	dummy.context(make_shared<Context>("A", "GG"));
+	HardConstraintConstPtr padded = dummy.macrostate_constraint("a");
+	CHECK(padded->dot_bracket() == ".(..)..");
+	CHECK(padded->operations()[0].i == 2);
+	CHECK(padded->operations()[0].j == 5);
+
+	// Any context with the same lengths gives the same constraint.
+	copy->context(make_shared<Context>("U", "UU"));
+	CHECK(copy->macrostate_constraint("a") == padded);
+
+	// Changing a macrostate makes a new table, with nothing compiled yet.
+	dummy.add_macrostate("a", "....");
+	CHECK(dummy.macrostate_constraint("a")->dot_bracket() == ".......");
+	CHECK(copy->macrostate_constraint("a") == padded);
+}
+
 TEST_CASE("Test the Aptamer class", "[model]") {
 	Aptamer theo(
 			"GAUACCAGCCGAAAGGCCCUUGGCAGC",
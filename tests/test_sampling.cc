@@ -1,3 +1,7 @@
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <limits>
 #include <catch/catch.hpp>
 #include "model.hh"
 #include "sampling.hh"
@@ -24,6 +28,11 @@ TEST_CASE("Correctly identify mutable positions", "[sampling]") {
 		CHECK(can_be_freely_mutated(device, 3) == false);
 		CHECK(can_be_freely_mutated(device, 4) == false);
 		CHECK(can_be_freely_mutated(device, 5) == false);
+
+		CHECK(device->position_graph()->free_positions() == vector<int>({0, 1}));
+		CHECK(device->position_graph()->component(2) == vector<int>({0, 2}));
+		CHECK(device->position_graph()->complementary(0, 2) == true);
+		CHECK_THROWS(device->position_graph()->component(3));
 	}
 
 	SECTION("multiple macrostates") {
@@ -93,8 +102,13 @@ TEST_CASE("Correctly mutate base-paired positions", "[sampling]") {
 			}
 
 			CAPTURE(test.mutations);
+			DevicePtr linked_device = device->copy();
+
 			mutate_recursively(device, i, test.mutations[i]);
 			CHECK(device->seq() == test.expected_sequences[i]);
+
+			mutate_linked_positions(linked_device, i, test.mutations[i]);
+			CHECK(linked_device->seq() == test.expected_sequences[i]);
 		}
 	}
 
@@ -111,5 +125,626 @@ TEST_CASE("Correctly mutate base-paired positions", "[sampling]") {
 	device->add_macrostate("extra close", ")");
 	CHECK_THROWS(mutate_recursively(device, 0, 'G'));
 
+	// The position graph reports the same errors up front.
+	device = make_shared<Device>("Nn");
+	device->add_macrostate("not mutable", "()");
+	CHECK_THROWS(device->position_graph());
+
+	device = make_shared<Device>("N");
+	device->add_macrostate("extra open", "(");
+	CHECK_THROWS(device->position_graph());
+
+	device = make_shared<Device>("N");
+	device->add_macrostate("extra close", ")");
+	CHECK_THROWS(device->position_graph());
+
+	device = make_shared<Device>("NNN");
+	device->add_macrostate("a", "(.)");
+	device->add_macrostate("b", "().");
+	device->add_macrostate("c", ".()");
+	CHECK_THROWS(device->position_graph());
+	CHECK_THROWS(mutate_recursively(device, 0, 'G'));
+
+}
+
+class CountingTerm : public ScoreTerm {
+
+public:
+
+	/// @brief Penalize every occurrence of the given nucleotide.
+	CountingTerm(char nuc): ScoreTerm(string(1, nuc)), my_nuc(nuc) {}
+
+	double
+	evaluate(DeviceConstPtr device, RnaFold const &, RnaFold const &) const {
+		string seq = device->seq();
+		return -std::count(seq.begin(), seq.end(), my_nuc);
+	}
+
+	double
+	max_value() const {
+		return 0;
+	}
+
+private:
+	char my_nuc;
+
+};
+
+class SequenceRecorder : public Reporter {
+
+public:
+
+	void
+	update(MonteCarloStep const &step) {
+		sequences.push_back(step.current_device->seq());
+		if(std::isnan(step.score_diff)) num_unscored++;
+		num_steps = step.num_steps;
+	}
+
+	vector<string> sequences;
+	int num_unscored = 0;
+	int num_steps = 0;
+
+};
+
+TEST_CASE("Early rejection doesn't change the trajectory", "[sampling]") {
+	ScoreFunctionPtr scorefxn = make_shared<ScoreFunction>();
+	*scorefxn += make_shared<CountingTerm>('A');
+	*scorefxn += make_shared<CountingTerm>('G');
+	int num_unscored = 0;
+
+	auto simulate = [&](bool early_rejection) {
+		MonteCarlo sampler;
+		auto recorder = make_shared<SequenceRecorder>();
+		sampler.num_steps(500);
+		sampler.scorefxn(scorefxn);
+		sampler.thermostat(make_shared<FixedThermostat>(0.5));
+		sampler.early_rejection(early_rejection);
+		sampler += make_shared<UnbiasedMutationMove>();
+		sampler += recorder;
+
+		std::mt19937 rng(1);
+		sampler.apply(make_shared<Device>("ACGUACGUACGU"), rng);
+		num_unscored = recorder->num_unscored;
+		return recorder->sequences;
+	};
+
+	vector<string> normal = simulate(false);
+	CHECK(num_unscored == 0);
+
+	// Moves that are rejected early don't get a score.
+	vector<string> early = simulate(true);
+	CHECK(num_unscored > 0);
+
+	CHECK(normal == early);
+	CHECK(scorefxn->counters().terms_skipped > 0);
+}
+
+TEST_CASE("Unscored moves are still written to the trajectory", "[sampling]") {
+	ScoreFunctionPtr scorefxn = make_shared<ScoreFunction>();
+	*scorefxn += make_shared<CountingTerm>('A');
+	*scorefxn += make_shared<CountingTerm>('G');
+
+	string const path = "test_unscored_moves.tsv";
+	MonteCarlo sampler;
+	sampler.num_steps(200);
+	sampler.scorefxn(scorefxn);
+	sampler.thermostat(make_shared<FixedThermostat>(0.5));
+	sampler.early_rejection(true);
+	sampler += make_shared<UnbiasedMutationMove>();
+	sampler += make_shared<TsvTrajectoryReporter>(path, 1);
+
+	std::mt19937 rng(1);
+	MonteCarloStep step;
+	sampler.start(step, make_shared<Device>("ACGUACGUACGU"), rng);
+	while(step.i < step.num_steps) {
+		sampler.iterate(step, rng);
+
+		// Unchanged moves are scored, because the score is already known.
+		if(step.outcome == OutcomeEnum::ACCEPT_UNCHANGED) {
+			CHECK(step.score_diff == 0);
+		}
+	}
+	sampler.finish(step);
+
+	// Every step gets a row, besides the two header lines.
+	std::ifstream tsv(path);
+	string line;
+	int num_lines = 0;
+	while(std::getline(tsv, line)) num_lines++;
+	CHECK(num_lines == 2 + 200);
+
+	std::remove(path.c_str());
+}
+
+TEST_CASE("Test delayed acceptance", "[sampling]") {
+	ScoreFunctionPtr scorefxn = make_shared<ScoreFunction>();
+	*scorefxn += make_shared<CountingTerm>('A');
+	*scorefxn += make_shared<CountingTerm>('G');
+
+	MonteCarlo sampler;
+	auto recorder = make_shared<SequenceRecorder>();
+	sampler.scorefxn(scorefxn);
+	sampler.thermostat(make_shared<FixedThermostat>(0.5));
+	sampler += make_shared<UnbiasedMutationMove>();
+	sampler += recorder;
+
+	std::mt19937 rng(1);
+
+	SECTION("an exact surrogate makes every rejection a prescreen rejection") {
+		MonteCarloStep step;
+		sampler.num_steps(500);
+		sampler.surrogate_scorefxn(scorefxn);
+		sampler.start(step, make_shared<Device>("ACGUACGUACGU"), rng);
+
+		int prescreen_rejections = 0;
+		while(step.i < step.num_steps) {
+			sampler.iterate(step, rng);
+			if(step.prescreen_rejected) {
+				prescreen_rejections++;
+				CHECK(std::isnan(step.score_diff));
+			}
+		}
+
+		CHECK(prescreen_rejections > 0);
+		CHECK(prescreen_rejections == step.outcome_counters[OutcomeEnum::REJECT]);
+		CHECK(prescreen_rejections == sampler.counters().prescreen_rejections);
+	}
+
+	SECTION("an approximate surrogate still samples the right distribution") {
+		// The surrogate only knows about one of the two terms.  With one 
+		// mutable position, the exact score is -1 for A and G and 0 for C and U.
+		ScoreFunctionPtr surrogate = make_shared<ScoreFunction>();
+		*surrogate += make_shared<CountingTerm>('A');
+
+		sampler.num_steps(20000);
+		sampler.surrogate_scorefxn(surrogate);
+		sampler.apply(make_shared<Device>("A"), rng);
+
+		map<string, double> frequencies;
+		for(auto const &seq: recorder->sequences) {
+			frequencies[seq] += 1.0 / recorder->sequences.size();
+		}
+
+		double z = 2 + 2 * exp(-1 / 0.5);
+		CHECK(frequencies["A"] == Approx(exp(-1 / 0.5) / z).epsilon(0.2));
+		CHECK(frequencies["G"] == Approx(exp(-1 / 0.5) / z).epsilon(0.2));
+		CHECK(frequencies["C"] == Approx(1 / z).epsilon(0.05));
+		CHECK(frequencies["U"] == Approx(1 / z).epsilon(0.05));
+
+		CHECK(sampler.counters().prescreen_rejections > 0);
+		CHECK(sampler.counters().prescreened > sampler.counters().prescreen_rejections);
+	}
+
+	SECTION("moves rejected by the prescreen don't train the thermostat") {
+		AutoScalingThermostat thermostat(0.5, 2, 1.0);
+		MonteCarloStep step;
+
+		step.score_diff = std::numeric_limits<double>::quiet_NaN();
+		CHECK(thermostat.adjust(step) == 1.0);
+		CHECK(thermostat.adjust(step) == 1.0);
+
+		step.score_diff = -1;
+		CHECK(thermostat.adjust(step) == 1.0);
+		CHECK(thermostat.adjust(step) == Approx(-1 / log(0.5)));
+	}
+}
+
+TEST_CASE("Test speculative proposals", "[sampling]") {
+	ScoreFunctionPtr scorefxn = make_shared<ScoreFunction>();
+	*scorefxn += make_shared<CountingTerm>('A');
+	*scorefxn += make_shared<CountingTerm>('G');
+
+	auto simulate = [&](int num_proposals, int num_steps, string seq) {
+		MonteCarlo sampler;
+		auto recorder = make_shared<SequenceRecorder>();
+		sampler.scorefxn(scorefxn);
+		sampler.thermostat(make_shared<FixedThermostat>(0.5));
+		sampler.num_steps(num_steps);
+		sampler.speculation(num_proposals);
+		sampler += make_shared<UnbiasedMutationMove>();
+		sampler += recorder;
+
+		std::mt19937 rng(1);
+		sampler.apply(make_shared<Device>(seq), rng);
+
+		// Every step uses up exactly one proposal.
+		MonteCarloCounters counters = sampler.counters();
+		CHECK(counters.speculative_proposals - 
+				counters.speculative_proposals_discarded == 
+				(num_proposals > 1? num_steps : 0));
+
+		return recorder->sequences;
+	};
+
+	SECTION("the trajectory only depends on the number of proposals") {
+		CHECK(simulate(4, 200, "ACGUACGUACGU") == simulate(4, 200, "ACGUACGUACGU"));
+		CHECK(simulate(4, 200, "ACGUACGUACGU") != simulate(1, 200, "ACGUACGUACGU"));
+	}
+
+	SECTION("the right distribution is still sampled") {
+		// With one mutable position, the score is -1 for A and G and 0 for C 
+		// and U.
+		map<string, double> frequencies;
+		vector<string> sequences = simulate(8, 20000, "A");
+		for(auto const &seq: sequences) {
+			frequencies[seq] += 1.0 / sequences.size();
+		}
+
+		double z = 2 + 2 * exp(-1 / 0.5);
+		CHECK(frequencies["A"] == Approx(exp(-1 / 0.5) / z).epsilon(0.2));
+		CHECK(frequencies["G"] == Approx(exp(-1 / 0.5) / z).epsilon(0.2));
+		CHECK(frequencies["C"] == Approx(1 / z).epsilon(0.05));
+		CHECK(frequencies["U"] == Approx(1 / z).epsilon(0.05));
+	}
+
+	SECTION("bad settings are rejected") {
+		MonteCarlo sampler;
+		CHECK_THROWS(sampler.speculation(0));
+
+		sampler.speculation(2);
+		sampler.surrogate_scorefxn(scorefxn);
+		sampler += make_shared<UnbiasedMutationMove>();
+
+		std::mt19937 rng(1);
+		CHECK_THROWS(sampler.apply(make_shared<Device>("A"), rng));
+	}
+}
+
+TEST_CASE("Test the HeatBathMove class", "[sampling]") {
+	ScoreFunctionPtr scorefxn = make_shared<ScoreFunction>();
+	*scorefxn += make_shared<CountingTerm>('A');
+	*scorefxn += make_shared<CountingTerm>('G');
+
+	MonteCarlo sampler;
+	auto recorder = make_shared<SequenceRecorder>();
+	sampler.scorefxn(scorefxn);
+	sampler += make_shared<HeatBathMove>();
+	sampler += recorder;
+
+	std::mt19937 rng(1);
+
+	SECTION("there's an option for every base") {
+		DevicePtr device = make_shared<Device>("CAAG");
+		device->add_macrostate("hairpin", "(..)");
+
+		vector<DevicePtr> options;
+		while(options.empty() or options[0]->seq()[0] != 'A') {
+			options = HeatBathMove().heat_bath_options(device, rng);
+		}
+
+		REQUIRE(options.size() == 4);
+		CHECK(options[0]->seq() == "AAAU");
+		CHECK(options[1]->seq() == "CAAG");
+		CHECK(options[2]->seq() == "GAAC");
+		CHECK(options[3]->seq() == "UAAA");
+		CHECK(device->seq() == "CAAG");
+	}
 
+	SECTION("every move is accepted") {
+		sampler.thermostat(make_shared<FixedThermostat>(0.5));
+		sampler.num_steps(500);
+
+		MonteCarloStep step;
+		sampler.start(step, make_shared<Device>("ACGUACGUACGU"), rng);
+		while(step.i < step.num_steps) {
+			sampler.iterate(step, rng);
+		}
+		sampler.finish(step);
+
+		CHECK(step.outcome_counters[OutcomeEnum::REJECT] == 0);
+		CHECK(step.outcome_counters[OutcomeEnum::ACCEPT_WORSENED] > 0);
+	}
+
+	SECTION("the right distribution is sampled") {
+		// With one mutable position, the score is -1 for A and G and 0 for C 
+		// and U.
+		sampler.thermostat(make_shared<FixedThermostat>(0.5));
+		sampler.num_steps(20000);
+		sampler.apply(make_shared<Device>("A"), rng);
+
+		map<string, double> frequencies;
+		for(auto const &seq: recorder->sequences) {
+			frequencies[seq] += 1.0 / recorder->sequences.size();
+		}
+
+		double z = 2 + 2 * exp(-1 / 0.5);
+		CHECK(frequencies["A"] == Approx(exp(-1 / 0.5) / z).epsilon(0.2));
+		CHECK(frequencies["G"] == Approx(exp(-1 / 0.5) / z).epsilon(0.2));
+		CHECK(frequencies["C"] == Approx(1 / z).epsilon(0.05));
+		CHECK(frequencies["U"] == Approx(1 / z).epsilon(0.05));
+	}
+
+	SECTION("the best base is picked at zero temperature") {
+		sampler.thermostat(make_shared<FixedThermostat>(0));
+		sampler.num_steps(100);
+
+		string seq = sampler.apply(make_shared<Device>("AGAG"), rng)->seq();
+		CHECK(seq.find_first_of("AG") == string::npos);
+	}
+}
+
+TEST_CASE("Test the SteepestDescent class", "[sampling]") {
+	SteepestDescent descent;
+	auto recorder = make_shared<SequenceRecorder>();
+	descent += recorder;
+
+	SECTION("each step takes the best mutation until none is better") {
+		ScoreFunctionPtr scorefxn = make_shared<ScoreFunction>();
+		*scorefxn += make_shared<CountingTerm>('A');
+		descent.scorefxn(scorefxn);
+
+		DevicePtr device = make_shared<Device>("AAAA");
+		DevicePtr optimum = descent.apply(device);
+
+		CHECK(device->seq() == "AAAA");
+		CHECK(optimum->seq() == "CCCC");
+		CHECK(recorder->sequences == vector<string>({
+				"CAAA", "CCAA", "CCCA", "CCCC", "CCCC"}));
+		CHECK(recorder->num_steps == 5);
+
+		// The first scan scores all 12 neighbors.  Every later scan has already 
+		// seen the 3 neighbors at the position that was just mutated, and after 
+		// the second scan, one neighbor that the starting device also had.
+		SteepestDescentCounters counters = descent.counters();
+		CHECK(counters.neighbors_scored == 12 + 9 + 3 * 8);
+		CHECK(counters.neighbors_reused == 3 + 3 * 4);
+	}
+
+	SECTION("linked positions are mutated together") {
+		ScoreFunctionPtr scorefxn = make_shared<ScoreFunction>();
+		*scorefxn += make_shared<CountingTerm>('C');
+		descent.scorefxn(scorefxn);
+
+		DevicePtr device = make_shared<Device>("CAAG");
+		device->add_macrostate("hairpin", "(..)");
+
+		CHECK(descent.apply(device)->seq() == "AAAU");
+	}
+
+	SECTION("the number of steps can be limited") {
+		ScoreFunctionPtr scorefxn = make_shared<ScoreFunction>();
+		*scorefxn += make_shared<CountingTerm>('A');
+		descent.scorefxn(scorefxn);
+		descent.max_steps(2);
+
+		CHECK(descent.apply(make_shared<Device>("AAAA"))->seq() == "CCAA");
+		CHECK(recorder->sequences.size() == 2);
+		CHECK(recorder->num_steps == 2);
+	}
+}
+
+TEST_CASE("Test the GeneticAlgorithm class", "[sampling]") {
+	ScoreFunctionPtr scorefxn = make_shared<ScoreFunction>();
+	*scorefxn += make_shared<CountingTerm>('A');
+
+	GeneticAlgorithm evolution;
+	auto recorder = make_shared<SequenceRecorder>();
+	evolution.scorefxn(scorefxn);
+	evolution.population_size(20);
+	evolution.num_generations(30);
+	evolution += make_shared<UnbiasedMutationMove>();
+	evolution += recorder;
+
+	SECTION("the population improves every generation") {
+		DevicePtr device = make_shared<Device>("AAAAAAAA");
+		std::mt19937 rng(1);
+		DevicePtr best = evolution.apply(device, rng);
+
+		CHECK(device->seq() == "AAAAAAAA");
+		CHECK(best->seq().find('A') == string::npos);
+		CHECK(recorder->sequences.size() == 30);
+		CHECK(recorder->sequences.back() == best->seq());
+
+		// The elite means the best score can never get worse.
+		vector<GenerationStats> const &stats = evolution.generation_stats();
+		REQUIRE(stats.size() == 31);
+		CHECK(stats[0].num_scored == 20);
+		CHECK(stats[0].diversity > 0);
+
+		for(int i = 1; i < stats.size(); i++) {
+			CHECK(stats[i].num_scored == 19);
+			CHECK(stats[i].best_score >= stats[i-1].best_score);
+			CHECK(stats[i].mean_score <= stats[i].best_score);
+		}
+	}
+
+	SECTION("the results only depend on the seed") {
+		auto evolve = [&](int seed) {
+			std::mt19937 rng(seed);
+			return evolution.apply(make_shared<Device>("AAAAAAAA"), rng)->seq();
+		};
+		CHECK(evolve(1) == evolve(1));
+	}
+
+	SECTION("crossover keeps linked positions together") {
+		// Without mutations, every child is a mix of the initial mutants.
+		evolution.mutation_rate(0);
+		evolution.crossover_rate(1);
+
+		DevicePtr device = make_shared<Device>("GCAAAAGC");
+		device->add_macrostate("hairpin", "((....))");
+
+		std::mt19937 rng(1);
+		evolution.apply(device, rng);
+
+		map<char, char> const pairs = {
+			{'A','U'}, {'C','G'}, {'G','C'}, {'U','A'}};
+
+		for(string const &seq: recorder->sequences) {
+			CHECK(seq[0] == pairs.at(seq[7]));
+			CHECK(seq[1] == pairs.at(seq[6]));
+		}
+	}
+
+	SECTION("bad settings are rejected") {
+		std::mt19937 rng(1);
+		evolution.num_elites(20);
+		CHECK_THROWS(evolution.apply(make_shared<Device>("A"), rng));
+		CHECK_THROWS(evolution.tournament_size(0));
+		CHECK_THROWS(GeneticAlgorithm().apply(make_shared<Device>("A"), rng));
+	}
+}
+
+TEST_CASE("Test the PopulationAnnealing class", "[sampling]") {
+	ScoreFunctionPtr scorefxn = make_shared<ScoreFunction>();
+	*scorefxn += make_shared<CountingTerm>('A');
+	*scorefxn += make_shared<CountingTerm>('G');
+
+	PopulationAnnealing annealer;
+	auto recorder = make_shared<SequenceRecorder>();
+	annealer.scorefxn(scorefxn);
+	annealer.temperatures({4, 2, 1, 0.5});
+	annealer.population_size(2000);
+	annealer += make_shared<UnbiasedMutationMove>();
+	annealer += recorder;
+
+	SECTION("the free energy matches the partition function") {
+		// With one mutable position, the score is -1 for A and G and 0 for C 
+		// and U, so Z(T) = 2 + 2 exp(-1/T).
+		std::mt19937 rng(1);
+		annealer.apply(make_shared<Device>("A"), rng);
+
+		auto z = [](double temperature) {
+			return 2 + 2 * exp(-1 / temperature);
+		};
+
+		vector<AnnealingStats> const &stats = annealer.annealing_stats();
+		REQUIRE(stats.size() == 4);
+		CHECK(recorder->sequences.size() == 4);
+
+		CHECK(stats[0].free_energy == 0);
+		CHECK(stats[0].effective_size == 2000);
+		CHECK(stats[0].num_families == 2000);
+
+		for(int t = 1; t < stats.size(); t++) {
+			double temperature = stats[t].temperature;
+			CHECK(stats[t].free_energy == Approx(-log(z(temperature) / z(4))).epsilon(0.05));
+			CHECK(stats[t].effective_size > 1000);
+			CHECK(stats[t].effective_size <= 2000);
+			CHECK(stats[t].num_families <= stats[t-1].num_families);
+			CHECK(stats[t].best_score == 0);
+		}
+
+		// The fraction of walkers with each score should match the Boltzmann 
+		// distribution at the last temperature.
+		double p_best = 2 / z(0.5);
+		CHECK(stats[3].mean_score == Approx(-(1 - p_best)).epsilon(0.1));
+	}
+
+	SECTION("the results don't depend on the number of threads") {
+		auto anneal = [&](int num_threads) {
+			std::mt19937 rng(1);
+			annealer.population_size(50);
+			annealer.num_threads(num_threads);
+			annealer.apply(make_shared<Device>("AAAAAAAA"), rng);
+
+			vector<double> free_energies;
+			for(auto const &stats: annealer.annealing_stats()) {
+				free_energies.push_back(stats.free_energy);
+			}
+			return free_energies;
+		};
+		CHECK(anneal(1) == anneal(4));
+	}
+
+	SECTION("bad settings are rejected") {
+		CHECK_THROWS(annealer.temperatures({}));
+		CHECK_THROWS(annealer.temperatures({1, 0}));
+		CHECK_THROWS(annealer.num_threads(0));
+
+		std::mt19937 rng(1);
+		CHECK_THROWS(PopulationAnnealing().apply(make_shared<Device>("A"), rng));
+	}
+}
+
+TEST_CASE("Test the ReplicaExchange class", "[sampling]") {
+	ScoreFunctionPtr scorefxn = make_shared<ScoreFunction>();
+	*scorefxn += make_shared<CountingTerm>('A');
+	*scorefxn += make_shared<CountingTerm>('G');
+
+	vector<shared_ptr<SequenceRecorder> > recorders;
+
+	auto make_exchange = [&](vector<double> temperatures) {
+		ReplicaExchange exchange;
+		recorders.clear();
+
+		for(double temperature: temperatures) {
+			auto replica = make_shared<MonteCarlo>();
+			auto recorder = make_shared<SequenceRecorder>();
+			replica->num_steps(100);
+			replica->scorefxn(scorefxn);
+			replica->thermostat(make_shared<FixedThermostat>(temperature));
+			*replica += make_shared<UnbiasedMutationMove>();
+			*replica += recorder;
+			exchange += replica;
+			recorders.push_back(recorder);
+		}
+
+		return exchange;
+	};
+
+	DevicePtr device = make_shared<Device>("ACGUACGUACGU");
+
+	SECTION("every replica runs for the requested number of steps") {
+		ReplicaExchange exchange = make_exchange({0.1, 1, 10});
+		exchange.swap_interval(7);
+		std::mt19937 rng(1);
+		exchange.apply(device, rng);
+
+		for(auto recorder: recorders) {
+			CHECK(recorder->sequences.size() == 100);
+		}
+		CHECK(device->seq() == "ACGUACGUACGU");
+	}
+
+	SECTION("there is one acceptance rate for each pair of replicas") {
+		ReplicaExchange exchange = make_exchange({0.1, 1, 10});
+		std::mt19937 rng(1);
+		exchange.apply(device, rng);
+
+		vector<double> rates = exchange.swap_acceptance_rates();
+		REQUIRE(rates.size() == 2);
+		for(double rate: rates) {
+			CHECK(rate >= 0);
+			CHECK(rate <= 1);
+		}
+	}
+
+	SECTION("swaps between replicas at the same temperature are accepted") {
+		ReplicaExchange exchange = make_exchange({1, 1});
+		exchange.swap_interval(20);
+		std::mt19937 rng(1);
+		DevicePtr result = exchange.apply(device, rng);
+
+		CHECK(exchange.swap_acceptance_rates()[0] == Approx(1));
+
+		// Nothing is swapped after the last step, so the coldest replica ends 
+		// with the device it last reported.
+		CHECK(result->seq() == recorders[0]->sequences.back());
+	}
+
+	SECTION("the results don't depend on the number of threads") {
+		ReplicaExchange serial = make_exchange({0.1, 0.5, 1, 2});
+		std::mt19937 serial_rng(1);
+		serial.apply(device, serial_rng);
+		auto serial_recorders = recorders;
+
+		ReplicaExchange parallel = make_exchange({0.1, 0.5, 1, 2});
+		parallel.num_threads(4);
+		std::mt19937 parallel_rng(1);
+		parallel.apply(device, parallel_rng);
+
+		for(int k = 0; k < recorders.size(); k++) {
+			CHECK(serial_recorders[k]->sequences == recorders[k]->sequences);
+		}
+		CHECK(serial.swap_acceptance_rates() == parallel.swap_acceptance_rates());
+	}
+
+	SECTION("replicas must have moves") {
+		ReplicaExchange exchange;
+		exchange += make_shared<MonteCarlo>();
+		std::mt19937 rng(1);
+		CHECK_THROWS(exchange.apply(device, rng));
+	}
 }
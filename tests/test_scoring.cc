@@ -1,6 +1,14 @@
+#include <cmath>
+#include <limits>
 #include <set>
 #include <vector>
 #include <catch/catch.hpp>
+
+extern "C" {
+  #include <ViennaRNA/part_func.h>
+  #include <ViennaRNA/constraints.h>
+}
+
 #include "model.hh"
 #include "scoring.hh"
 #include "utils.hh"
@@ -146,6 +154,40 @@ TEST_CASE("Test folding a hairpin without an aptamer", "[scoring]") {
 	}
 }
 
+TEST_CASE("Test reusing the ensemble free energy", "[scoring]") {
+	DevicePtr hairpin = make_shared<Device>("ACGUGAAAACGU");
+	ViennaRnaFold::reset_counters();
+
+	SECTION("the unconstrained partition function is only calculated once") {
+		ViennaRnaFold fold(hairpin);
+		double p1 = fold.macrostate_prob("((((....))))");
+		double p2 = fold.macrostate_prob("((((....))))");
+		fold.macrostate_prob("xxxx........");
+
+		CHECK(p1 == Approx(p2));
+		CHECK(ViennaRnaFold::counters().pf_calls == 4);
+		CHECK(ViennaRnaFold::counters().pf_calls_saved == 2);
+	}
+
+	SECTION("the base-pair probability calculation is reused") {
+		ViennaRnaFold fold(hairpin);
+		fold.base_pair_prob(0, 11);
+		fold.macrostate_prob("((((....))))");
+
+		CHECK(ViennaRnaFold::counters().pf_calls == 2);
+		CHECK(ViennaRnaFold::counters().pf_calls_saved == 1);
+	}
+
+	SECTION("the counters can be reset") {
+		ViennaRnaFold fold(hairpin);
+		fold.macrostate_prob("((((....))))");
+		ViennaRnaFold::reset_counters();
+
+		CHECK(ViennaRnaFold::counters().pf_calls == 0);
+		CHECK(ViennaRnaFold::counters().pf_calls_saved == 0);
+	}
+}
+
 TEST_CASE("Test folding a hairpin with an aptamer", "[scoring]") {
 	// Make a device consisting entirely of an aptamer:
 
@@ -327,6 +369,26 @@ TEST_CASE("Test the score function class with contexts", "[scoring]") {
 		scorefxn.add_context("3", make_shared<Context>("a", "aa"));
 		CHECK(scorefxn.evaluate(dummy_device) == Approx(9.0));
 	}
+
+	SECTION("the contexts can be evaluated in parallel") {
+		for(int i = 0; i < 10; i++) {
+			string before(i, 'a');
+			scorefxn.add_context(to_string(i), make_shared<Context>(before, ""));
+		}
+
+		EvaluatedScoreFunction serial_table, parallel_table;
+		double serial_score = scorefxn.evaluate(dummy_device, serial_table);
+		scorefxn.num_threads(4);
+		double parallel_score = scorefxn.evaluate(dummy_device, parallel_table);
+
+		CHECK(serial_score == parallel_score);
+		CHECK(serial_table.schema == parallel_table.schema);
+		CHECK(serial_table.values == parallel_table.values);
+	}
+
+	SECTION("there must be at least one thread") {
+		CHECK_THROWS(scorefxn.num_threads(0));
+	}
 }
 
 TEST_CASE("Test the 'macrostate prob' score term", "[scoring]") {
@@ -383,3 +445,680 @@ TEST_CASE("Test the 'macrostate prob' score term", "[scoring]") {
 	}
 }
 
+
+TEST_CASE("Test the 'ensemble defect' score term", "[scoring]") {
+	DevicePtr device = make_shared<Device>("ACGUAG");
+	device->add_macrostate("hairpin", "((xx))");
+	device->add_macrostate("loose", "(....)");
+
+	DummyRnaFold apo_fold, holo_fold;
+	apo_fold[{0,5}] = 0.8;
+	apo_fold[{1,4}] = 0.5;
+	apo_fold[{2,5}] = 0.1;  // pairs an 'x' position with a constrained one
+	holo_fold[{0,5}] = 1.0;
+	holo_fold[{1,4}] = 1.0;
+
+	SECTION("the defect counts every constrained position") {
+		EnsembleDefectTerm term("hairpin", ConditionEnum::APO);
+		CHECK(term.name() == "apo: defect hairpin");
+		CHECK(term.max_value() == 0);
+
+		// Satisfied: 2×0.8 + 2×0.5 for the pairs, 0.9 + 1.0 for the unpaired 
+		// positions, out of 6 positions.
+		double expected = -(1 - (1.6 + 1.0 + 0.9 + 1.0) / 6);
+		CHECK(term.evaluate(device, apo_fold, holo_fold) == Approx(expected));
+	}
+
+	SECTION("unconstrained positions aren't counted") {
+		EnsembleDefectTerm term("loose", ConditionEnum::APO);
+		CHECK(term.evaluate(device, apo_fold, holo_fold) == Approx(-0.2));
+	}
+
+	SECTION("a perfectly folded ensemble has no defect") {
+		EnsembleDefectTerm term("hairpin", ConditionEnum::HOLO);
+		CHECK(term.name() == "holo: defect hairpin");
+		CHECK(term.evaluate(device, apo_fold, holo_fold) == Approx(0));
+	}
+
+	SECTION("unfavorable folds penalize the satisfied positions") {
+		EnsembleDefectTerm term("hairpin", ConditionEnum::HOLO, FavorableEnum::NO);
+		CHECK(term.name() == "holo: defect not hairpin");
+		CHECK(term.evaluate(device, apo_fold, holo_fold) == Approx(-1));
+	}
+
+	SECTION("the defect is calculated in the right context") {
+		device->context(make_shared<Context>("G", ""));
+		apo_fold[{1,6}] = 1.0;
+
+		EnsembleDefectTerm term("loose", ConditionEnum::APO);
+		CHECK(term.evaluate(device, apo_fold, holo_fold) == Approx(0));
+	}
+
+	SECTION("one partition function is shared by every defect term") {
+		ViennaRnaFold::reset_counters();
+		ViennaRnaFold fold(device);
+
+		EnsembleDefectTerm hairpin("hairpin", ConditionEnum::APO);
+		EnsembleDefectTerm loose("loose", ConditionEnum::APO);
+		double defect_1 = hairpin.evaluate(device, fold, fold);
+		double defect_2 = loose.evaluate(device, fold, fold);
+
+		CHECK(defect_1 <= 0);
+		CHECK(defect_1 >= -1);
+		CHECK(defect_2 <= 0);
+		CHECK(defect_2 >= -1);
+		CHECK(ViennaRnaFold::counters().pf_calls == 1);
+	}
+}
+
+TEST_CASE("Test the score function schema", "[scoring]") {
+	ScoreFunction scorefxn;
+	scorefxn += make_shared<MacrostateProbTerm>("a", ConditionEnum::APO);
+	scorefxn += make_shared<MacrostateProbTerm>("b", ConditionEnum::HOLO);
+
+	SECTION("without contexts") {
+		ScoreSchemaConstPtr schema = scorefxn.schema();
+		CHECK(schema->num_terms == 2);
+		CHECK(schema->num_contexts == 1);
+		CHECK(schema->names == vector<string>({"apo: a", "holo: b"}));
+		CHECK(schema->weights == vector<double>({1, 1}));
+		CHECK(schema->weighted_sum({2, 3}) == Approx(5));
+	}
+
+	SECTION("with contexts") {
+		scorefxn.add_context("x", make_shared<Context>("A", ""));
+		scorefxn.add_context("y", make_shared<Context>("", "A"));
+
+		ScoreSchemaConstPtr schema = scorefxn.schema();
+		CHECK(schema->size() == 4);
+		CHECK(schema->names == vector<string>(
+					{"x: apo: a", "x: holo: b", "y: apo: a", "y: holo: b"}));
+		CHECK(schema->term_ids == vector<int>({0, 1, 0, 1}));
+		CHECK(schema->context_ids == vector<int>({0, 0, 1, 1}));
+		CHECK(schema->context_names == vector<string>({"x", "y"}));
+		CHECK(schema->weighted_sum({1, 2, 3, 4}) == Approx(10));
+	}
+}
+
+TEST_CASE("Test building a surrogate score function", "[scoring]") {
+	ScoreFunction scorefxn;
+	scorefxn.aptamer(THEO_APTAMER);
+	scorefxn.add_context("a", make_shared<Context>("A", "A"));
+
+	auto apo_term = make_shared<MacrostateProbTerm>(
+			"active", ConditionEnum::APO, FavorableEnum::NO);
+	apo_term->weight(2);
+	scorefxn += apo_term;
+	scorefxn += make_shared<EnsembleDefectTerm>("active", ConditionEnum::HOLO);
+
+	// Terms without surrogates are left out.
+	ScoreFunctionPtr surrogate = scorefxn.surrogate();
+	CHECK(surrogate->aptamer() == THEO_APTAMER);
+	CHECK(surrogate->context("a") == scorefxn.context("a"));
+	REQUIRE(surrogate->schema()->size() == 1);
+	CHECK(surrogate->schema()->names[0] == "a: apo: mfe not active");
+	CHECK(surrogate->schema()->weights[0] == 2);
+
+	// The default estimate is just the macrostate probability.
+	DevicePtr device = make_shared<Device>("");
+	device->add_macrostate("active", "");
+	DummyRnaFold apo_fold(0.3), holo_fold(0.6);
+
+	MfeMacrostateProbTerm holo_term("active", ConditionEnum::HOLO);
+	CHECK(holo_term.name() == "holo: mfe active");
+	CHECK(holo_term.evaluate(device, apo_fold, holo_fold) == Approx(log(0.6)));
+}
+
+TEST_CASE("Test the score cache class", "[scoring]") {
+	EvaluatedScoreFunction table_a = {nullptr, {1.0}};
+	EvaluatedScoreFunction table_b = {nullptr, {2.0}};
+	EvaluatedScoreFunction table_c = {nullptr, {3.0}};
+	EvaluatedScoreFunction table;
+	double score;
+
+	SECTION("missing keys aren't found") {
+		ScoreCache cache(2);
+		CHECK_FALSE(cache.lookup("a", score, table));
+		CHECK(cache.counters().misses == 1);
+		CHECK(cache.counters().hits == 0);
+	}
+
+	SECTION("stored keys are found") {
+		ScoreCache cache(2);
+		cache.store("a", 1.0, table_a);
+		REQUIRE(cache.lookup("a", score, table));
+		CHECK(score == 1.0);
+		CHECK(table.values == vector<double>({1.0}));
+		CHECK(cache.counters().hits == 1);
+	}
+
+	SECTION("the least recently used key is evicted") {
+		ScoreCache cache(2, EvictionEnum::LRU);
+		cache.store("a", 1.0, table_a);
+		cache.store("b", 2.0, table_b);
+		cache.lookup("a", score, table);
+		cache.store("c", 3.0, table_c);
+
+		CHECK(cache.size() == 2);
+		CHECK(cache.counters().evictions == 1);
+		CHECK(cache.lookup("a", score, table));
+		CHECK_FALSE(cache.lookup("b", score, table));
+		CHECK(cache.lookup("c", score, table));
+	}
+
+	SECTION("the first key is evicted") {
+		ScoreCache cache(2, EvictionEnum::FIFO);
+		cache.store("a", 1.0, table_a);
+		cache.store("b", 2.0, table_b);
+		cache.lookup("a", score, table);
+		cache.store("c", 3.0, table_c);
+
+		CHECK(cache.size() == 2);
+		CHECK(cache.counters().evictions == 1);
+		CHECK_FALSE(cache.lookup("a", score, table));
+		CHECK(cache.lookup("b", score, table));
+		CHECK(cache.lookup("c", score, table));
+	}
+
+	SECTION("caches without capacity don't remember anything") {
+		ScoreCache cache(0);
+		cache.store("a", 1.0, table_a);
+		CHECK(cache.size() == 0);
+		CHECK_FALSE(cache.lookup("a", score, table));
+	}
+}
+
+TEST_CASE("Test the score function class with a cache", "[scoring]") {
+	ScoreFunction scorefxn;
+	ScoreCachePtr cache = make_shared<ScoreCache>(10);
+	scorefxn.cache(cache);
+
+	class CountingTerm : public ScoreTerm {
+
+	public:
+
+		CountingTerm(double weight=1):
+			ScoreTerm("counting", weight), my_count(0) {}
+
+		double
+		evaluate(DeviceConstPtr device, RnaFold const &, RnaFold const &) const {
+			return ++my_count;
+		}
+
+		int count() const { return my_count; }
+
+	private:
+		mutable int my_count;
+
+	};
+
+	auto term = make_shared<CountingTerm>();
+	scorefxn += term;
+
+	DevicePtr device_1 = make_shared<Device>("UUUU");
+	DevicePtr device_2 = make_shared<Device>("AAAA");
+
+	SECTION("repeated sequences aren't rescored") {
+		CHECK(scorefxn.evaluate(device_1) == Approx(1));
+		CHECK(scorefxn.evaluate(device_1) == Approx(1));
+		CHECK(scorefxn.evaluate(device_1->copy()) == Approx(1));
+		CHECK(term->count() == 1);
+		CHECK(cache->counters().hits == 2);
+		CHECK(cache->counters().misses == 1);
+	}
+
+	SECTION("different sequences are rescored") {
+		CHECK(scorefxn.evaluate(device_1) == Approx(1));
+		CHECK(scorefxn.evaluate(device_2) == Approx(2));
+		CHECK(term->count() == 2);
+	}
+
+	SECTION("different macrostates are rescored") {
+		DevicePtr device_3 = device_1->copy();
+		device_3->add_macrostate("a", "(..)");
+		CHECK(scorefxn.evaluate(device_1) == Approx(1));
+		CHECK(scorefxn.evaluate(device_3) == Approx(2));
+	}
+
+	SECTION("different contexts are rescored") {
+		CHECK(scorefxn.evaluate(device_1) == Approx(1));
+		scorefxn.add_context("a", make_shared<Context>("A", ""));
+		CHECK(scorefxn.evaluate(device_1) == Approx(2));
+	}
+
+	SECTION("devices in different contexts are rescored") {
+		DevicePtr device_3 = device_1->copy();
+		device_3->context(make_shared<Context>("A", ""));
+		CHECK(scorefxn.evaluate(device_1) == Approx(1));
+		CHECK(scorefxn.evaluate(device_3) == Approx(2));
+	}
+
+	SECTION("weights that differ in the last few digits are rescored") {
+		ScoreFunction other;
+		auto other_term = make_shared<CountingTerm>(1 + 1e-9);
+		other.cache(cache);
+		other += other_term;
+
+		scorefxn.evaluate(device_1);
+		other.evaluate(device_1);
+		CHECK(term->count() == 1);
+		CHECK(other_term->count() == 1);
+		CHECK(cache->counters().hits == 0);
+	}
+
+	SECTION("the score table is restored from the cache") {
+		EvaluatedScoreFunction table_1, table_2;
+		scorefxn.evaluate(device_1, table_1);
+		scorefxn.evaluate(device_1, table_2);
+		CHECK(table_2.schema == table_1.schema);
+		CHECK(table_2.values == table_1.values);
+	}
+}
+
+TEST_CASE("Test the fold compound pool", "[scoring]") {
+	FoldCompoundPool &pool = FoldCompoundPool::local();
+	pool.clear();
+	FoldCompoundPool::reset_counters();
+
+	DevicePtr hairpin_1 = make_shared<Device>("ACGUGAAAACGU");
+	DevicePtr hairpin_2 = make_shared<Device>("GCGCGAAAGCGC");
+	double p_fresh, p_reused;
+
+	SECTION("fold compounds are returned to the pool as soon as possible") {
+		{
+			// The unconstrained fold compound is recycled for the constrained 
+			// calculation.
+			ViennaRnaFold fold(hairpin_1);
+			fold.macrostate_prob("((((....))))");
+			CHECK(pool.size() == 1);
+		}
+		CHECK(pool.size() == 1);
+		CHECK(FoldCompoundPool::counters().allocations == 1);
+		CHECK(FoldCompoundPool::counters().reuses == 1);
+	}
+
+	SECTION("the base-pair probabilities are kept until they aren't needed") {
+		{
+			ViennaRnaFold fold(hairpin_1);
+			fold.base_pair_prob(0, 11);
+			fold.macrostate_prob("((((....))))");
+			CHECK(pool.size() == 1);
+		}
+		CHECK(pool.size() == 2);
+		CHECK(FoldCompoundPool::counters().allocations == 2);
+	}
+
+	SECTION("fold compounds are only reused for the same sequence") {
+		{
+			ViennaRnaFold fold(hairpin_1);
+			fold.macrostate_prob("((((....))))");
+		}
+		{
+			ViennaRnaFold fold(hairpin_2);
+			p_reused = fold.macrostate_prob("((((....))))");
+		}
+
+		// The idle fold compound for the first hairpin was freed, rather than 
+		// kept around for a sequence that won't come back.
+		CHECK(pool.size() == 1);
+		CHECK(FoldCompoundPool::counters().allocations == 2);
+		CHECK(FoldCompoundPool::counters().reuses == 2);
+
+		// Make sure the pooled fold compounds give the same answer as new ones.
+		pool.clear();
+		{
+			ViennaRnaFold fold(hairpin_2);
+			p_fresh = fold.macrostate_prob("((((....))))");
+		}
+		CHECK(p_reused == Approx(p_fresh));
+	}
+
+	SECTION("constraints are removed from recycled fold compounds") {
+		{
+			ViennaRnaFold fold(hairpin_1);
+			p_fresh = fold.macrostate_prob("((((....))))");
+		}
+		{
+			ViennaRnaFold fold(hairpin_1);
+			p_reused = fold.macrostate_prob("((((....))))");
+		}
+		CHECK(FoldCompoundPool::counters().reuses == 3);
+		CHECK(p_reused == Approx(p_fresh));
+	}
+
+	SECTION("fold compounds aren't reused for sequences of different lengths") {
+		{
+			ViennaRnaFold fold(hairpin_1);
+			fold.macrostate_prob("((((....))))");
+		}
+		{
+			ViennaRnaFold fold(make_shared<Device>("ACGUGAAACGU"));
+			fold.macrostate_prob("(((...)))..");
+		}
+		CHECK(FoldCompoundPool::counters().allocations == 2);
+		CHECK(FoldCompoundPool::counters().reuses == 2);
+	}
+
+	SECTION("the memory used by the DP matrices is tracked") {
+		// Other threads' pools may still be holding fold compounds from previous 
+		// tests, so only look at what changes.
+		long bytes_before = FoldCompoundPool::counters().bytes;
+		ViennaRnaFold::reset_counters();
+		{
+			ViennaRnaFold fold(hairpin_1);
+			fold.base_pair_prob(0, 11);
+			fold.macrostate_prob("((((....))))");
+			fold.macrostate_prob("xxxx........");
+		}
+
+		// The engine never holds more than the BPPM and one other fold compound, 
+		// so only two were allocated, and the engine held both at once.
+		long allocated_bytes = FoldCompoundPool::counters().bytes - bytes_before;
+		CHECK(allocated_bytes > 0);
+		CHECK(FoldCompoundPool::counters().allocations == 2);
+		CHECK(ViennaRnaFold::counters().peak_bytes == allocated_bytes);
+
+		pool.clear();
+		CHECK(FoldCompoundPool::counters().bytes == bytes_before);
+	}
+
+	pool.clear();
+}
+
+TEST_CASE("Test sharing Boltzmann factors between fold compounds", "[scoring]") {
+	FoldParameters const &parameters = FoldParameters::shared();
+	CHECK(&parameters == &FoldParameters::shared());
+	CHECK_FALSE(parameters.model_details(false).compute_bpp);
+	CHECK(parameters.model_details(true).compute_bpp);
+
+	// Fold compounds using the shared factors should give the same answers as 
+	// fold compounds that derive their own.
+	string seq = "GAUACCAGCCGAAAGGCCCUUGGCAGC";
+	vrna_md_t md = parameters.model_details(false);
+
+	vrna_fold_compound_t *fc_default =
+		vrna_fold_compound(seq.c_str(), &md, VRNA_OPTION_PF);
+	vrna_fold_compound_t *fc_shared = parameters.make_fold_compound(seq, false);
+
+	CHECK(fc_shared->exp_params->kT == Approx(fc_default->exp_params->kT));
+	CHECK(vrna_pf(fc_shared, NULL) == Approx(vrna_pf(fc_default, NULL)));
+
+	vrna_fold_compound_free(fc_default);
+	vrna_fold_compound_free(fc_shared);
+}
+
+TEST_CASE("Test applying compiled constraints", "[scoring]") {
+	// Adding the base pairs and unpaired positions one at a time should give 
+	// the same free energy as letting ViennaRNA parse the dot-bracket string.
+	string seq = "GAUACCAGCCGAAAGGCCCUUGGCAGC";
+	string macrostate = "xx......((....))....xx.....";
+	HardConstraint constraint(macrostate);
+	REQUIRE(constraint.is_compiled());
+
+	ViennaRnaFold fold(make_shared<Device>(seq));
+	double kT;
+	double g_compiled = fold.free_energy(&constraint, kT);
+
+	vrna_fold_compound_t *fc =
+		FoldParameters::shared().make_fold_compound(seq, false);
+	vrna_constraints_add(fc, macrostate.c_str(),
+			VRNA_CONSTRAINT_DB_DEFAULT | VRNA_CONSTRAINT_DB_ENFORCE_BP);
+	double g_parsed = vrna_pf(fc, NULL);
+	vrna_fold_compound_free(fc);
+
+	CHECK(g_compiled == Approx(g_parsed));
+}
+
+TEST_CASE("Test scoring several devices at once", "[scoring]") {
+	ScoreFunction scorefxn;
+
+	class DummyTerm : public ScoreTerm {
+
+	public:
+
+		DummyTerm(): ScoreTerm("dummy") {}
+
+		double
+		evaluate(DeviceConstPtr device, RnaFold const &, RnaFold const &) const {
+			string seq = device->seq();
+			return std::count(seq.begin(), seq.end(), 'A');
+		}
+
+	};
+	scorefxn += make_shared<DummyTerm>();
+
+	vector<DeviceConstPtr> devices = {
+		make_shared<Device>("UUU"),
+		make_shared<Device>("AUU"),
+		make_shared<Device>("AAU"),
+		make_shared<Device>("AAA"),
+	};
+
+	SECTION("an empty batch gives no scores") {
+		CHECK(scorefxn.evaluate_many({}).empty());
+	}
+
+	SECTION("the scores are returned in order") {
+		vector<double> scores = scorefxn.evaluate_many(devices);
+		REQUIRE(scores.size() == 4);
+		CHECK(scores[0] == Approx(0));
+		CHECK(scores[1] == Approx(1));
+		CHECK(scores[2] == Approx(2));
+		CHECK(scores[3] == Approx(3));
+	}
+
+	SECTION("the scores match those calculated one at a time") {
+		scorefxn.add_context("a", make_shared<Context>("A", ""));
+		scorefxn.add_context("b", make_shared<Context>("", "AA"));
+		scorefxn.num_threads(4);
+
+		vector<EvaluatedScoreFunction> tables;
+		vector<double> scores = scorefxn.evaluate_many(devices, tables);
+		REQUIRE(tables.size() == devices.size());
+
+		for(int i = 0; i < devices.size(); i++) {
+			EvaluatedScoreFunction table;
+			CHECK(scores[i] == scorefxn.evaluate(devices[i], table));
+			CHECK(tables[i].schema == table.schema);
+			CHECK(tables[i].values == table.values);
+		}
+	}
+
+	SECTION("cached devices aren't rescored") {
+		ScoreCachePtr cache = make_shared<ScoreCache>(10);
+		scorefxn.cache(cache);
+		scorefxn.evaluate(devices[1]);
+
+		vector<double> scores = scorefxn.evaluate_many(devices);
+		CHECK(scores[1] == Approx(1));
+		CHECK(cache->counters().hits == 1);
+		CHECK(cache->counters().misses == 4);
+		CHECK(cache->size() == 4);
+	}
+}
+
+TEST_CASE("Test planning partition functions", "[scoring]") {
+	DevicePtr hairpin = make_shared<Device>("ACGUGAAAACGU");
+	hairpin->add_macrostate("active", "((((....))))");
+
+	ScoreFunction scorefxn;
+	scorefxn.aptamer(THEO_APTAMER);
+	scorefxn += make_shared<MacrostateProbTerm>("active", ConditionEnum::APO);
+	scorefxn += make_shared<MacrostateProbTerm>(
+			"active", ConditionEnum::APO, FavorableEnum::NO);
+
+	SECTION("duplicate partition functions are merged") {
+		FoldPlan plan = scorefxn.plan({hairpin, hairpin->copy()});
+		CHECK(plan.num_requests() == 8);
+		REQUIRE(plan.jobs().size() == 2);
+
+		// Nothing is folded with the aptamer, because no term needs it.
+		for(auto const &job: plan.jobs()) {
+			CHECK(job.aptamer == nullptr);
+		}
+		CHECK(plan.jobs()[0].constraint == nullptr);
+		CHECK(plan.jobs()[1].constraint == hairpin->macrostate_constraint("active"));
+	}
+
+	SECTION("the holo condition is only folded if it's needed") {
+		scorefxn += make_shared<MacrostateProbTerm>("active", ConditionEnum::HOLO);
+		FoldPlan plan = scorefxn.plan({hairpin});
+		REQUIRE(plan.jobs().size() == 4);
+		CHECK(plan.jobs()[2].aptamer == THEO_APTAMER);
+		CHECK(plan.jobs()[3].aptamer == THEO_APTAMER);
+	}
+
+	SECTION("the longest jobs are run first") {
+		scorefxn.add_context("a", make_shared<Context>("", "A"));
+		scorefxn.add_context("b", make_shared<Context>("AAAA", "AAAA"));
+		FoldPlan plan = scorefxn.plan({hairpin});
+		REQUIRE(plan.jobs().size() == 4);
+
+		vector<int> order = plan.order();
+		CHECK(order == vector<int>({2, 3, 0, 1}));
+	}
+
+	SECTION("each job is timed") {
+		FoldPlan plan = scorefxn.plan({hairpin});
+		plan.run(2);
+		for(auto const &job: plan.jobs()) {
+			CHECK(job.seconds >= 0);
+			CHECK(job.kT > 0);
+		}
+	}
+
+	SECTION("the planned jobs give the same scores") {
+		ViennaRnaFold fold(hairpin);
+		double p = fold.macrostate_prob("((((....))))");
+
+		ViennaRnaFold::reset_counters();
+		scorefxn.num_threads(2);
+
+		EvaluatedScoreFunction table;
+		scorefxn.evaluate(hairpin, table);
+		CHECK(table.values[0] == Approx(log(p)));
+		CHECK(ViennaRnaFold::counters().pf_calls == 2);
+		CHECK(scorefxn.counters().fold_requests == 4);
+		CHECK(scorefxn.counters().fold_jobs == 2);
+
+		// The time spent on each job is added up by condition and macrostate.
+		auto timings = scorefxn.counters().fold_timings;
+		REQUIRE(timings.size() == 2);
+		CHECK(timings.count({ConditionEnum::APO, ""}) == 1);
+		CHECK(timings.count({ConditionEnum::APO, "active"}) == 1);
+		for(auto const &item: timings) {
+			CHECK(item.second.jobs == 1);
+			CHECK(item.second.seconds >= 0);
+		}
+
+		// Both jobs may have been folded at once, but never more than that.
+		long peak_bytes = scorefxn.counters().peak_bytes_per_evaluation;
+		CHECK(peak_bytes > 0);
+		CHECK(peak_bytes <= 2 * FoldCompoundPool::counters().bytes);
+	}
+}
+
+TEST_CASE("Test abandoning hopeless score function evaluations", "[scoring]") {
+	ScoreFunction scorefxn;
+	DevicePtr device = make_shared<Device>("UUUU");
+
+	class BoundedTerm : public ScoreTerm {
+
+	public:
+
+		BoundedTerm(double score, double weight=1):
+			ScoreTerm("bounded", weight), my_score(score) {}
+
+		double
+		evaluate(DeviceConstPtr, RnaFold const &, RnaFold const &) const {
+			return my_score;
+		}
+
+		double
+		max_value() const {
+			return 0;
+		}
+
+	private:
+		double my_score;
+
+	};
+
+	scorefxn += make_shared<BoundedTerm>(-1);
+	scorefxn += make_shared<BoundedTerm>(-2);
+	scorefxn += make_shared<BoundedTerm>(-4);
+
+	EvaluatedScoreFunction table;
+	bool rejected;
+
+	SECTION("reachable thresholds give the full score") {
+		CHECK(scorefxn.evaluate_or_reject(device, table, -7, rejected) == Approx(-7));
+		CHECK_FALSE(rejected);
+		REQUIRE(table.values.size() == 3);
+		CHECK(table.values[2] == Approx(-4));
+		CHECK(scorefxn.counters().terms_skipped == 0);
+	}
+
+	SECTION("unreachable thresholds give an upper bound") {
+		CHECK(scorefxn.evaluate_or_reject(device, table, -2, rejected) == Approx(-3));
+		CHECK(rejected);
+		REQUIRE(table.values.size() == 3);
+		CHECK(table.values[0] == Approx(-1));
+		CHECK(table.values[1] == Approx(-2));
+		CHECK(std::isnan(table.values[2]));
+		CHECK(scorefxn.counters().terms_evaluated == 2);
+		CHECK(scorefxn.counters().terms_skipped == 1);
+	}
+
+	SECTION("partition functions for contexts that are never reached are counted") {
+		class FoldingTerm : public BoundedTerm {
+		public:
+			FoldingTerm(): BoundedTerm(-8) {}
+			FoldRequestList fold_requests() const {
+				return {{ConditionEnum::APO, "open"}};
+			}
+		};
+
+		// The shortest context is folded first, and the device is rejected 
+		// before the longer one is needed.
+		device->add_macrostate("open", "....");
+		scorefxn += make_shared<FoldingTerm>();
+		scorefxn.add_context("long", make_shared<Context>("AAAA", "AAAA"));
+		scorefxn.add_context("short", make_shared<Context>("A", ""));
+		ViennaRnaFold::reset_counters();
+		scorefxn.evaluate_or_reject(device, table, -2, rejected);
+		CHECK(rejected);
+		CHECK(ViennaRnaFold::counters().pf_calls == 2);
+		CHECK(ViennaRnaFold::counters().pf_calls_skipped == 2);
+		CHECK(scorefxn.counters().fold_jobs == 2);
+	}
+
+	SECTION("unbounded terms are never skipped") {
+		scorefxn += make_shared<BoundedTerm>(-1, -1);
+		CHECK(scorefxn.evaluate_or_reject(device, table, 0, rejected) == Approx(-6));
+		CHECK_FALSE(rejected);
+		CHECK(scorefxn.counters().terms_skipped == 0);
+	}
+
+	SECTION("terms that are NaN by themselves don't cause rejections") {
+		scorefxn += make_shared<BoundedTerm>(
+				std::numeric_limits<double>::quiet_NaN());
+		scorefxn.evaluate_or_reject(device, table, -100, rejected);
+		CHECK_FALSE(rejected);
+		CHECK(std::isnan(table.values[3]));
+		CHECK(scorefxn.counters().terms_skipped == 0);
+	}
+
+	SECTION("the full score matches evaluate()") {
+		scorefxn.add_context("long", make_shared<Context>("AAAA", "AAAA"));
+		scorefxn.add_context("short", make_shared<Context>("A", ""));
+
+		EvaluatedScoreFunction expected_table;
+		double expected_score = scorefxn.evaluate(device, expected_table);
+		double score = scorefxn.evaluate_or_reject(device, table, -100, rejected);
+
+		CHECK(score == expected_score);
+		CHECK(table.schema == expected_table.schema);
+		CHECK(table.values == expected_table.values);
+	}
+}